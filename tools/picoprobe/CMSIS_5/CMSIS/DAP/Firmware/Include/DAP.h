@@ -202,6 +202,7 @@ typedef struct {
   uint8_t     fast_clock;                       // Fast Clock Flag
   uint8_t     padding[2];
   uint32_t   clock_delay;                       // Clock Delay
+  uint32_t    clock_freq;                       // Requested SWJ Clock in Hz
   uint32_t     timestamp;                       // Last captured Timestamp
   struct {                                      // Transfer Configuration
     uint8_t   idle_cycles;                      // Idle cycles after transfer
@@ -246,7 +247,13 @@ extern void     JTAG_IR         (uint32_t ir);
 extern uint32_t JTAG_ReadIDCode (void);
 extern void     JTAG_WriteAbort (uint32_t data);
 extern uint8_t  JTAG_Transfer   (uint32_t request, uint32_t *data);
+extern void     JTAG_SWJ_Sequence (uint32_t count, const uint8_t *data);
 extern uint8_t  SWD_Transfer    (uint32_t request, uint32_t *data);
+extern uint8_t  SWD_TransferReadBlock (uint32_t request, uint8_t *data, uint32_t count, uint32_t *done);
+extern uint32_t SWJ_ClockGet    (void);
+extern uint32_t SWJ_ClockSearch (uint32_t min_khz, uint32_t max_khz, uint32_t ram_addr, uint32_t targetsel, uint32_t *idcode);
+extern uint32_t SWJ_SelectPort  (uint32_t port);
+extern uint32_t SWD_SelectTarget (uint32_t targetsel, uint32_t *dpidr);
 
 extern void     Delayms         (uint32_t delay);
 
@@ -261,6 +268,7 @@ extern uint32_t SWO_Data           (const uint8_t *request, uint8_t *response);
 extern void     SWO_QueueTransfer    (uint8_t *buf, uint32_t num);
 extern void     SWO_AbortTransfer    (void);
 extern void     SWO_TransferComplete (void);
+extern void     SWO_Thread           (void *argument);
 
 extern uint32_t UART_SWO_Mode     (uint32_t enable);
 extern uint32_t UART_SWO_Baudrate (uint32_t baudrate);
@@ -217,6 +217,13 @@ static uint32_t DAP_Connect(const uint8_t *request, uint8_t *response) {
 #endif
 #if (DAP_JTAG != 0)
     case DAP_PORT_JTAG:
+#if (PROBE_PORTS > 1)
+      // Only the first port has TDI/TDO
+      if (probe_get_port() != 0U) {
+        port = DAP_PORT_DISABLED;
+        break;
+      }
+#endif
       DAP_Data.debug_port = DAP_PORT_JTAG;
       PORT_JTAG_SETUP();
       break;
@@ -378,6 +385,7 @@ static uint32_t DAP_SWJ_Clock(const uint8_t *request, uint8_t *response) {
     return ((4U << 16) | 1U);
   }
 
+  DAP_Data.clock_freq = clock;
   if (clock >= MAX_SWJ_CLOCK(DELAY_FAST_CYCLES)) {
     DAP_Data.fast_clock  = 1U;
     DAP_Data.clock_delay = 1U;
@@ -1302,6 +1310,10 @@ static uint32_t DAP_SWD_TransferBlock(const uint8_t *request, uint8_t *response)
         goto end;
       }
     }
+#if (DAP_SWD_READ_BLOCK != 0)
+    response_value = SWD_TransferReadBlock(request_value, response, request_count, &response_count);
+    response += response_count * 4U;
+#else
     while (request_count--) {
       // Read DP/AP register
       if ((request_count == 0U) && ((request_value & DAP_TRANSFER_APnDP) != 0U)) {
@@ -1322,6 +1334,7 @@ static uint32_t DAP_SWD_TransferBlock(const uint8_t *request, uint8_t *response)
       *response++ = (uint8_t)(data >> 24);
       response_count++;
     }
+#endif
   } else {
     // Write register block
     while (request_count--) {
@@ -1753,6 +1766,7 @@ void DAP_Setup(void) {
   DAP_Data.debug_port  = 0U;
   DAP_Data.fast_clock  = 0U;
   DAP_Data.clock_delay = CLOCK_DELAY(DAP_DEFAULT_SWJ_CLOCK);
+  DAP_Data.clock_freq  = DAP_DEFAULT_SWJ_CLOCK;
   DAP_Data.transfer.idle_cycles = 0U;
   DAP_Data.transfer.retry_count = 100U;
   DAP_Data.transfer.match_retry = 0U;
@@ -27,6 +27,15 @@
  
 #include "DAP_config.h"
 #include "DAP.h"
+#include "FreeRTOS.h"
+#include "task.h"
+#include "cdc_uart.h"
+#include "dap_stats.h"
+#include "dap_flash.h"
+#include "task_stats.h"
+#ifdef PROBE_RTT
+#include "probe_rtt.h"
+#endif
 
 //**************************************************************************************************
 /** 
@@ -39,6 +48,21 @@ Vendor Commands. Copy this file to the project folder of the Debug Unit and add
 file to the MDK-ARM project under the file group Configuration.
 */
 
+static uint32_t get_u32(const uint8_t *p) {
+  return (uint32_t)(*(p+0) <<  0) |
+         (uint32_t)(*(p+1) <<  8) |
+         (uint32_t)(*(p+2) << 16) |
+         (uint32_t)(*(p+3) << 24);
+}
+
+static uint32_t put_u32(uint8_t *p, uint32_t val) {
+  *(p+0) = (uint8_t)(val >>  0);
+  *(p+1) = (uint8_t)(val >>  8);
+  *(p+2) = (uint8_t)(val >> 16);
+  *(p+3) = (uint8_t)(val >> 24);
+  return 4U;
+}
+
 /** Process DAP Vendor Command and prepare Response Data
 \param request   pointer to request data
 \param response  pointer to response data
@@ -47,28 +71,227 @@ file to the MDK-ARM project under the file group Configuration.
 */
 uint32_t DAP_ProcessVendorCommand(const uint8_t *request, uint8_t *response) {
   uint32_t num = (1U << 16) | 1U;
+  uint32_t val;
+  uint32_t idcode;
+  uint32_t id, n;
+  struct dap_flash_algo algo;
+#if (PROBE_DAP_CORE1 == 0)
+  struct task_stats task;
+#endif
+#ifdef PROBE_RTT
+  uint32_t up, down, errors;
+#endif
 
   *response++ = *request;        // copy Command ID
 
   switch (*request++) {          // first byte in request is Command ID
-    case ID_DAP_Vendor0:
-#if 0                            // example user command
-      num += 1U << 16;           // increment request count
-      if (*request == 1U) {      // when first command data byte is 1
-        *response++ = 'X';       // send 'X' as response
-        num++;                   // increment response count
+    case ID_DAP_Vendor0:         // SWCLK: 0 = get actual, 1 = search highest
+      num += 1U << 16;
+      switch (*request++) {
+        case 0U:
+          val = SWJ_ClockGet();
+          *response++ = DAP_OK;
+          num += put_u32(response, val) + 1U;
+          break;
+        case 1U:
+          // min kHz, max kHz, RAM test address, TARGETSEL -> max kHz, IDCODE
+          num += 16U << 16;
+          val = SWJ_ClockSearch(get_u32(request), get_u32(request + 4),
+                                get_u32(request + 8), get_u32(request + 12), &idcode);
+          *response++ = (val != 0U) ? DAP_OK : DAP_ERROR;
+          response += put_u32(response, val);
+          put_u32(response, idcode);
+          num += 9U;
+          break;
+        default:
+          *response = DAP_ERROR;
+          num++;
+          break;
+      }
+      break;
+
+    case ID_DAP_Vendor1:         // UART bridge counters
+      *response++ = DAP_OK;
+      response += put_u32(response, cdc_uart_stats.rx_bytes);
+      response += put_u32(response, cdc_uart_stats.tx_bytes);
+      response += put_u32(response, cdc_uart_stats.rx_dropped);
+      response += put_u32(response, cdc_uart_stats.uart_overrun);
+      response += put_u32(response, cdc_uart_stats.uart_break);
+      response += put_u32(response, cdc_uart_stats.uart_parity);
+      put_u32(response, cdc_uart_stats.uart_framing);
+      num += 1U + 7U * 4U;
+      break;
+
+    case ID_DAP_Vendor2:         // Per command timings: first ID, count
+      num += 2U << 16;
+      id = *request++;
+      n  = *request;
+      if (n > (DAP_PACKET_SIZE - 3U) / 12U) {
+        n = (DAP_PACKET_SIZE - 3U) / 12U;
+      }
+      if (n > 256U - id) {
+        n = 256U - id;
+      }
+      *response++ = DAP_OK;
+      *response++ = (uint8_t)n;
+      for (; n; n--, id++) {
+        response += put_u32(response, dap_cmd_stats[id].count);
+        response += put_u32(response, dap_cmd_stats[id].total_us);
+        response += put_u32(response, dap_cmd_stats[id].max_us);
+        num += 12U;
+      }
+      num += 2U;
+      break;
+
+    case ID_DAP_Vendor3:         // Transfer and ring counters: 0 = read, 1 = read then clear all
+      num += 1U << 16;
+      val = *request;
+      *response++ = DAP_OK;
+      response += put_u32(response, dap_xfer_stats.transfers);
+      response += put_u32(response, dap_xfer_stats.wait);
+      response += put_u32(response, dap_xfer_stats.fault);
+      response += put_u32(response, dap_xfer_stats.parity);
+      response += put_u32(response, dap_xfer_stats.protocol);
+      response += put_u32(response, dap_ring_stats.req_full);
+      response += put_u32(response, dap_ring_stats.req_empty);
+      response += put_u32(response, dap_ring_stats.resp_full);
+      put_u32(response, dap_xfer_stats.dropped);
+      num += 1U + 9U * 4U;
+      if (val == 1U) {
+        dap_stats_clear();
       }
-#endif
       break;
 
-    case ID_DAP_Vendor1:  break;
-    case ID_DAP_Vendor2:  break;
-    case ID_DAP_Vendor3:  break;
-    case ID_DAP_Vendor4:  break;
+    case ID_DAP_Vendor4:         // Flash programming
+      num += 1U << 16;
+      switch (*request++) {
+        case 0U:
+          // ProgramPage, static base, stack top, breakpoint, buffers 0 and 1, page size
+          num += 28U << 16;
+          algo.program_page = get_u32(request);
+          algo.static_base  = get_u32(request + 4);
+          algo.stack_top    = get_u32(request + 8);
+          algo.breakpoint   = get_u32(request + 12);
+          algo.buf[0]       = get_u32(request + 16);
+          algo.buf[1]       = get_u32(request + 20);
+          algo.page_size    = get_u32(request + 24);
+          *response = (uint8_t)dap_flash_setup(&algo);
+          num++;
+          break;
+        case 1U:
+          // Function, R0, R1, R2, timeout ms -> R0
+          num += 20U << 16;
+          *response++ = (uint8_t)dap_flash_call(get_u32(request), get_u32(request + 4),
+                                                get_u32(request + 8), get_u32(request + 12),
+                                                get_u32(request + 16), &val);
+          num += put_u32(response, val) + 1U;
+          break;
+        case 2U:
+          // Flash address of the image
+          num += 4U << 16;
+          *response = (uint8_t)dap_flash_start(get_u32(request));
+          num++;
+          break;
+        case 3U:
+          // Byte count (u16), then image data
+          n = (uint32_t)request[0] | ((uint32_t)request[1] << 8);
+          num += 2U << 16;
+          if (n > DAP_PACKET_SIZE - 4U) {
+            *response = DAP_ERROR;
+          } else {
+            num += n << 16;
+            *response = (uint8_t)dap_flash_write(request + 2, n);
+          }
+          num++;
+          break;
+        case 4U:
+          // -> result, failing address
+          *response++ = (uint8_t)dap_flash_finish(&val, &id);
+          response += put_u32(response, val);
+          put_u32(response, id);
+          num += 9U;
+          break;
+        default:
+          *response = DAP_ERROR;
+          num++;
+          break;
+      }
+      break;
+#ifdef PROBE_RTT
+    case ID_DAP_Vendor5:         // RTT polling
+      num += 1U << 16;
+      switch (*request++) {
+        case 0U:
+          // Search address, search size, poll interval ms (u32 each), up and down channel (u8 each)
+          num += 14U << 16;
+          *response = (uint8_t)probe_rtt_start(get_u32(request), get_u32(request + 4),
+                                               get_u32(request + 8), request[12], request[13]);
+          num++;
+          break;
+        case 1U:
+          probe_rtt_stop();
+          *response = DAP_OK;
+          num++;
+          break;
+        case 2U:
+          // -> state, control block address, bytes up, bytes down, errors
+          *response++ = DAP_OK;
+          *response++ = (uint8_t)probe_rtt_status(&val, &up, &down, &errors);
+          response += put_u32(response, val);
+          response += put_u32(response, up);
+          response += put_u32(response, down);
+          put_u32(response, errors);
+          num += 2U + 4U * 4U;
+          break;
+        default:
+          *response = DAP_ERROR;
+          num++;
+          break;
+      }
+      break;
+#else
     case ID_DAP_Vendor5:  break;
-    case ID_DAP_Vendor6:  break;
-    case ID_DAP_Vendor7:  break;
-    case ID_DAP_Vendor8:  break;
+#endif
+    case ID_DAP_Vendor6:         // Select SWD port -> number of ports
+      num += 1U << 16;
+      *response++ = (SWJ_SelectPort(*request) != 0U) ? DAP_OK : DAP_ERROR;
+      *response = PROBE_PORTS;
+      num += 2U;
+      break;
+    case ID_DAP_Vendor7:         // Select multi-drop target: TARGETSEL -> DPIDR
+      num += 4U << 16;
+      val = SWD_SelectTarget(get_u32(request), &idcode);
+      *response++ = (val == DAP_TRANSFER_OK) ? DAP_OK : DAP_ERROR;
+      put_u32(response, idcode);
+      num += 5U;
+      break;
+    case ID_DAP_Vendor8:         // Task stack and CPU use: task index
+      num += 1U << 16;
+#if (PROBE_DAP_CORE1 != 0)
+      // Core 1 runs outside FreeRTOS, and can't look at its tasks
+      *response = DAP_ERROR;
+      num++;
+#else
+      id = *request;
+      *response++ = DAP_OK;
+      *response++ = (uint8_t)task_stats_count();
+      response += put_u32(response, portGET_RUN_TIME_COUNTER_VALUE());
+      response += put_u32(response, task_stats_heap_free());
+      response += put_u32(response, task_stats_sram_free());
+      num += 14U;
+      if (task_stats_get(id, &task)) {
+        response += put_u32(response, task.stack_bytes);
+        response += put_u32(response, task.stack_unused);
+        response += put_u32(response, task.run_time_us);
+        *response++ = task.priority;
+        for (n = 0U; n < configMAX_TASK_NAME_LEN - 1U && task.name[n]; n++) {
+          *response++ = (uint8_t)task.name[n];
+        }
+        *response = 0U;
+        num += 13U + n + 1U;
+      }
+#endif
+      break;
     case ID_DAP_Vendor9:  break;
     case ID_DAP_Vendor10: break;
     case ID_DAP_Vendor11: break;
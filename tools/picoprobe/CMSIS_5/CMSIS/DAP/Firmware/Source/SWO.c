@@ -31,7 +31,8 @@
 #include "Driver_USART.h"
 #endif
 #if (SWO_STREAM != 0)
-#include "cmsis_os2.h"
+#include "FreeRTOS.h"
+#include "task.h"
 #endif
 
 #if (SWO_STREAM != 0)
@@ -62,6 +63,12 @@ static uint8_t USART_Ready = 0U;
 
 #define SWO_STREAM_TIMEOUT      50U     /* Stream timeout in ms */
 
+#if (PROBE_DAP_CORE1 != 0)
+#define SWO_IDLE_TIMEOUT        pdMS_TO_TICKS(SWO_STREAM_TIMEOUT)   /* No wake-up from SWO_Control */
+#else
+#define SWO_IDLE_TIMEOUT        portMAX_DELAY
+#endif
+
 #define USB_BLOCK_SIZE          512U    /* USB Block Size */
 #define TRACE_BLOCK_SIZE        64U     /* Trace Block Size (2^n: 32...512) */
 
@@ -95,9 +102,27 @@ static uint8_t  GetTraceStatus (void);
 static void     SetTraceError  (uint8_t flag);
 
 #if (SWO_STREAM != 0)
-extern osThreadId_t      SWO_ThreadId;
+extern TaskHandle_t      SWO_ThreadId;
 static volatile uint8_t  TransferBusy = 0U; /* Transfer Busy Flag */
 static          uint32_t TransferSize;      /* Current Transfer Size */
+
+// Wake the SWO Thread, from the USART callback or from a task
+static void SWO_Notify (void) {
+  BaseType_t woken = pdFALSE;
+
+#if (PROBE_DAP_CORE1 != 0)
+  // DAP commands run on core 1, outside FreeRTOS. SWO_Thread polls instead.
+  if (get_core_num() != 0U) {
+    return;
+  }
+#endif
+  if (portCHECK_IF_IN_ISR()) {
+    vTaskNotifyGiveFromISR(SWO_ThreadId, &woken);
+    portYIELD_FROM_ISR(woken);
+  } else {
+    xTaskNotifyGive(SWO_ThreadId);
+  }
+}
 #endif
 
 
@@ -135,7 +160,7 @@ static void USART_Callback (uint32_t event) {
 #if (SWO_STREAM != 0)
     if (TraceTransport == 2U) {
       if (count >= (USB_BLOCK_SIZE - (index_o & (USB_BLOCK_SIZE - 1U)))) {
-        osThreadFlagsSet(SWO_ThreadId, 1U);
+        SWO_Notify();
       }
     }
 #endif
@@ -177,16 +202,18 @@ __WEAK uint32_t UART_SWO_Mode (uint32_t enable) {
   return (1U);
 }
 
-// Configure UART SWO Baudrate
+// Configure USART SWO Mode and Baudrate
+//   mode:     USART control code for the mode
 //   baudrate: requested baudrate
+//   max:      maximum baudrate for the mode
 //   return:   actual baudrate or 0 when not configured
-__WEAK uint32_t UART_SWO_Baudrate (uint32_t baudrate) {
+static uint32_t USART_SWO_Baudrate (uint32_t mode, uint32_t baudrate, uint32_t max) {
   int32_t  status;
   uint32_t index;
   uint32_t num;
 
-  if (baudrate > SWO_UART_MAX_BAUDRATE) {
-    baudrate = SWO_UART_MAX_BAUDRATE;
+  if (baudrate > max) {
+    baudrate = max;
   }
 
   if (TraceStatus & DAP_SWO_CAPTURE_ACTIVE) {
@@ -197,11 +224,7 @@ __WEAK uint32_t UART_SWO_Baudrate (uint32_t baudrate) {
     }
   }
 
-  status = pUSART->Control(ARM_USART_MODE_ASYNCHRONOUS |
-                           ARM_USART_DATA_BITS_8       |
-                           ARM_USART_PARITY_NONE       |
-                           ARM_USART_STOP_BITS_1,
-                           baudrate);
+  status = pUSART->Control(mode, baudrate);
 
   if (status == ARM_DRIVER_OK) {
     USART_Ready = 1U;
@@ -223,6 +246,17 @@ __WEAK uint32_t UART_SWO_Baudrate (uint32_t baudrate) {
   return (baudrate);
 }
 
+// Configure UART SWO Baudrate
+//   baudrate: requested baudrate
+//   return:   actual baudrate or 0 when not configured
+__WEAK uint32_t UART_SWO_Baudrate (uint32_t baudrate) {
+  return (USART_SWO_Baudrate(ARM_USART_MODE_ASYNCHRONOUS |
+                             ARM_USART_DATA_BITS_8       |
+                             ARM_USART_PARITY_NONE       |
+                             ARM_USART_STOP_BITS_1,
+                             baudrate, SWO_UART_MAX_BAUDRATE));
+}
+
 // Control UART SWO Capture
 //   active: active flag
 //   return: 1 - Success, 0 - Error
@@ -278,6 +312,47 @@ __WEAK uint32_t UART_SWO_GetCount (void) {
 
 #if (SWO_MANCHESTER != 0)
 
+#if (SWO_UART != 0) && defined(SWO_USART_MODE_MANCHESTER)
+
+// Manchester SWO is received by the same USART driver as UART SWO,
+// switched to Manchester decoding with SWO_USART_MODE_MANCHESTER.
+
+// Enable or disable Manchester SWO Mode
+//   enable: enable flag
+//   return: 1 - Success, 0 - Error
+__WEAK uint32_t Manchester_SWO_Mode (uint32_t enable) {
+  return (UART_SWO_Mode(enable));
+}
+
+// Configure Manchester SWO Baudrate
+//   baudrate: requested baudrate
+//   return:   actual baudrate or 0 when not configured
+__WEAK uint32_t Manchester_SWO_Baudrate (uint32_t baudrate) {
+  return (USART_SWO_Baudrate(SWO_USART_MODE_MANCHESTER, baudrate, SWO_MANCHESTER_MAX_BAUDRATE));
+}
+
+// Control Manchester SWO Capture
+//   active: active flag
+//   return: 1 - Success, 0 - Error
+__WEAK uint32_t Manchester_SWO_Control (uint32_t active) {
+  return (UART_SWO_Control(active));
+}
+
+// Start Manchester SWO Capture
+//   buf: pointer to buffer for capturing
+//   num: number of bytes to capture
+__WEAK void Manchester_SWO_Capture (uint8_t *buf, uint32_t num) {
+  UART_SWO_Capture(buf, num);
+}
+
+// Get Manchester SWO Pending Trace Count
+//   return: number of pending trace data bytes
+__WEAK uint32_t Manchester_SWO_GetCount (void) {
+  return (UART_SWO_GetCount());
+}
+
+#else
+
 // Enable or disable Manchester SWO Mode
 //   enable: enable flag
 //   return: 1 - Success, 0 - Error
@@ -308,8 +383,11 @@ __WEAK void Manchester_SWO_Capture (uint8_t *buf, uint32_t num) {
 // Get Manchester SWO Pending Trace Count
 //   return: number of pending trace data bytes
 __WEAK uint32_t Manchester_SWO_GetCount (void) {
+  return (0U);
 }
 
+#endif
+
 #endif  /* (SWO_MANCHESTER != 0) */
 
 
@@ -595,7 +673,7 @@ uint32_t SWO_Control (const uint8_t *request, uint8_t *response) {
       TraceStatus = active;
 #if (SWO_STREAM != 0)
       if (TraceTransport == 2U) {
-        osThreadFlagsSet(SWO_ThreadId, 1U);
+        SWO_Notify();
       }
 #endif
     }
@@ -741,27 +819,27 @@ void SWO_TransferComplete (void) {
   TraceIndexO += TransferSize;
   TransferBusy = 0U;
   ResumeTrace();
-  osThreadFlagsSet(SWO_ThreadId, 1U);
+  SWO_Notify();
 }
 
 // SWO Thread
 __NO_RETURN void SWO_Thread (void *argument) {
-  uint32_t timeout;
+  TickType_t timeout;
   uint32_t flags;
   uint32_t count;
   uint32_t index;
   uint32_t i, n;
   (void)   argument;
 
-  timeout = osWaitForever;
+  timeout = SWO_IDLE_TIMEOUT;
 
   for (;;) {
-    flags = osThreadFlagsWait(1U, osFlagsWaitAny, timeout);
+    flags = ulTaskNotifyTake(pdTRUE, timeout);
     if (TraceStatus & DAP_SWO_CAPTURE_ACTIVE) {
-      timeout = SWO_STREAM_TIMEOUT;
+      timeout = pdMS_TO_TICKS(SWO_STREAM_TIMEOUT);
     } else {
-      timeout = osWaitForever;
-      flags   = osFlagsErrorTimeout;
+      timeout = SWO_IDLE_TIMEOUT;
+      flags   = 0U;
     }
     if (TransferBusy == 0U) {
       count = GetTraceCount();
@@ -771,7 +849,7 @@ __NO_RETURN void SWO_Thread (void *argument) {
         if (count > n) {
           count = n;
         }
-        if (flags != osFlagsErrorTimeout) {
+        if (flags != 0U) {
           i = index & (USB_BLOCK_SIZE - 1U);
           if (i == 0U) {
             count &= ~(USB_BLOCK_SIZE - 1U);
@@ -68,9 +68,22 @@ This information includes:
 /// This information is returned by the command \ref DAP_Info as part of <b>Capabilities</b>.
 #define DAP_SWD                 1               ///< SWD Mode:  1 = available, 0 = not available.
 
+/// Pipelined SWD register block reads with SWD_TransferReadBlock. This relies on the
+/// PIO state machine checking the ACK, so it is tied to PROBE_SWD_XFER.
+#if defined(PROBE_SWD_XFER)
+#define DAP_SWD_READ_BLOCK      1               ///< SWD block read: 1 = pipelined, 0 = one SWD_Transfer per register.
+#else
+#define DAP_SWD_READ_BLOCK      0               ///< SWD block read: 1 = pipelined, 0 = one SWD_Transfer per register.
+#endif
+
 /// Indicate that JTAG communication mode is available at the Debug Port.
 /// This information is returned by the command \ref DAP_Info as part of <b>Capabilities</b>.
+/// JTAG needs TDI and TDO pins on top of SWCLK/TCK and SWDIO/TMS, see the board config.
+#if defined(PROBE_PIN_TDI) && defined(PROBE_PIN_TDO)
+#define DAP_JTAG                1               ///< JTAG Mode: 1 = available, 0 = not available.
+#else
 #define DAP_JTAG                0               ///< JTAG Mode: 1 = available, 0 = not available.
+#endif
 
 /// Configure maximum number of JTAG devices on the scan chain connected to the Debug Access Port.
 /// This setting impacts the RAM requirements of the Debug Unit. Valid range is 1 .. 255.
@@ -89,33 +102,61 @@ This information includes:
 /// This configuration settings is used to optimize the communication performance with the
 /// debugger and depends on the USB peripheral. Typical vales are 64 for Full-speed USB HID or WinUSB,
 /// 1024 for High-speed USB HID and 512 for High-speed USB WinUSB.
+/// The RP2040 is a Full-speed device, so larger packets are carried as multi-packet bulk
+/// transfers and reassembled by the v2 endpoint driver. HID (v1) is limited to 64.
+#ifndef DAP_PACKET_SIZE
 #define DAP_PACKET_SIZE         64U            ///< Specifies Packet Size in bytes.
+#endif
 
 /// Maximum Package Buffers for Command and Response data.
 /// This configuration settings is used to optimize the communication performance with the
 /// debugger and depends on the USB peripheral. For devices with limited RAM or USB buffer the
 /// setting can be reduced (valid range is 1 .. 255).
-#define DAP_PACKET_COUNT        2U              ///< Specifies number of packets buffered.
+/// Debugprobe executes commands in place in its USB ring, so this is also the number of
+/// requests the host may keep in flight. Must be a power of 2.
+#ifndef DAP_PACKET_COUNT
+#define DAP_PACKET_COUNT        8U              ///< Specifies number of packets buffered.
+#endif
 
 /// Indicate that UART Serial Wire Output (SWO) trace is available.
 /// This information is returned by the command \ref DAP_Info as part of <b>Capabilities</b>.
+/// SWO is captured by a PIO state machine on PROBE_PIN_SWO, so it needs a board with a spare pin.
+#if defined(PROBE_PIN_SWO)
+#define SWO_UART                1               ///< SWO UART:  1 = available, 0 = not available.
+#else
 #define SWO_UART                0               ///< SWO UART:  1 = available, 0 = not available.
+#endif
 
 /// USART Driver instance number for the UART SWO.
 #define SWO_UART_DRIVER         0               ///< USART Driver instance number (Driver_USART#).
 
 /// Maximum SWO UART Baudrate.
-#define SWO_UART_MAX_BAUDRATE   10000000U       ///< SWO UART Maximum Baudrate in Hz.
+#define SWO_UART_MAX_BAUDRATE   (CPU_CLOCK / 8U)        ///< SWO UART Maximum Baudrate in Hz.
 
 /// Indicate that Manchester Serial Wire Output (SWO) trace is available.
 /// This information is returned by the command \ref DAP_Info as part of <b>Capabilities</b>.
-#define SWO_MANCHESTER          0               ///< SWO Manchester:  1 = available, 0 = not available.
+/// Manchester SWO uses the same USART driver as UART SWO, switched with SWO_USART_MODE_MANCHESTER.
+#define SWO_MANCHESTER          SWO_UART        ///< SWO Manchester:  1 = available, 0 = not available.
+
+/// Maximum SWO Manchester Baudrate.
+#define SWO_MANCHESTER_MAX_BAUDRATE (CPU_CLOCK / 16U)   ///< SWO Manchester Maximum Baudrate in Hz.
+
+/// USART driver control code that selects Manchester receive; arg = Baudrate.
+#define SWO_USART_MODE_MANCHESTER (0x80UL << ARM_USART_CONTROL_Pos)
+
+/// Hook the SWO USART driver's DMA interrupt. Called once from main(), so that the
+/// interrupt stays on core 0 even when DAP commands power the driver up on core 1.
+void swo_pio_init(void);
 
 /// SWO Trace Buffer Size.
-#define SWO_BUFFER_SIZE         4096U           ///< SWO Trace Buffer Size in bytes (must be 2^n).
+#define SWO_BUFFER_SIZE         16384U          ///< SWO Trace Buffer Size in bytes (must be 2^n).
 
 /// SWO Streaming Trace.
+#if (SWO_UART != 0) && (PROBE_DEBUG_PROTOCOL == PROTO_DAP_V2)
+#define SWO_STREAM              1               ///< SWO Streaming Trace: 1 = available, 0 = not available.
+#else
 #define SWO_STREAM              0               ///< SWO Streaming Trace: 1 = available, 0 = not available.
+#endif
 
 /// Clock frequency of the Test Domain Timer. Timer value is returned with \ref TIMESTAMP_GET.
 #define TIMESTAMP_CLOCK         1000000U      ///< Timestamp clock in Hz (0 = timestamps not supported).
@@ -301,13 +342,30 @@ of the same I/O port. The following SWDIO I/O Pin functions are provided:
 
 // Configure DAP I/O pins ------------------------------
 
+// hack - zap our "stop doing divides everywhere" cache. SWD and JTAG share the
+// PIO clock divider, swj_update_clock() reprograms it when DAP_Data.clock_freq changes.
+extern volatile uint32_t cached_freq;
+void swj_update_clock(void);
+
+// Last value written to the current target's DP SELECT register over SWD, so
+// that work the probe does on its own (RTT polling) can put back what the host
+// last selected.
+extern uint32_t swd_dp_select;
+
+// Drop the probe's knowledge of every target's SELECT and CSW, as a new
+// connection may find the targets reset.
+void swd_targets_forget(void);
+
 /** Setup JTAG I/O pins: TCK, TMS, TDI, TDO, nTRST, and nRESET.
 Configures the DAP Hardware I/O pins for JTAG mode:
  - TCK, TMS, TDI, nTRST, nRESET to output mode and set to high level.
  - TDO to input mode.
 */
 __STATIC_INLINE void PORT_JTAG_SETUP (void) {
-  ;
+#if (DAP_JTAG != 0)
+  probe_jtag_init();
+  cached_freq = 0;
+#endif
 }
 
 /** Setup SWD I/O pins: SWCLK, SWDIO, and nRESET.
@@ -315,11 +373,10 @@ Configures the DAP Hardware I/O pins for Serial Wire Debug (SWD) mode:
  - SWCLK, SWDIO, nRESET to output mode and set to default high level.
  - TDI, nTRST to HighZ mode (pins are unused in SWD mode).
 */
-// hack - zap our "stop doing divides everywhere" cache
-extern volatile uint32_t cached_delay;
 __STATIC_INLINE void PORT_SWD_SETUP (void) {
   probe_init();
-  cached_delay = 0;
+  cached_freq = 0;
+  swd_targets_forget();
 }
 
 /** Disable JTAG/SWD I/O Pins.
@@ -561,7 +618,10 @@ Status LEDs. In detail the operation of Hardware I/O and LED pins are enabled an
  - LED output pins are enabled and LEDs are turned off.
 */
 __STATIC_INLINE void DAP_SETUP (void) {
-  probe_gpio_init();
+  probe_gpio_init(pio0, PROBE_PIN_OFFSET);
+#if (PROBE_PORTS > 1)
+  probe_gpio_init(pio0, PROBE_PORT1_PIN_OFFSET);
+#endif
 }
 
 /** Reset Target Device with custom specific I/O pin or command sequence.
@@ -37,6 +37,7 @@
 // For level-shifted input.
 #define PROBE_PIN_SWDI (PROBE_PIN_OFFSET + 1)
 #define PROBE_PIN_SWDIO (PROBE_PIN_OFFSET + 2)
+// No SWO pin - the connectors carry SWD and UART only
 
 // UART config
 #define PROBE_UART_TX 4
@@ -39,6 +39,13 @@
 #define PROBE_CDC_UART
 /* Target reset GPIO (active-low). Omit if not used.*/
 #define PROBE_PIN_RESET 1
+/* SWO trace input GPIO, captured by PIO1 as UART or Manchester. Omit if not used. */
+#define PROBE_PIN_SWO 11
+/* JTAG pins. TCK/TMS are normally SWCLK/SWDIO and TDO is normally SWO. Omit TDI/TDO if not used. */
+#define PROBE_PIN_TCK PROBE_PIN_SWCLK
+#define PROBE_PIN_TMS PROBE_PIN_SWDIO
+#define PROBE_PIN_TDI 10
+#define PROBE_PIN_TDO PROBE_PIN_SWO
 
 #define PROBE_SM 0
 #define PROBE_PIN_OFFSET 12
@@ -34,6 +34,19 @@
 #define PROBE_PIN_OFFSET 2
 #define PROBE_PIN_SWCLK (PROBE_PIN_OFFSET + 0) // 2
 #define PROBE_PIN_SWDIO (PROBE_PIN_OFFSET + 1) // 3
+// Second SWD port for a second target: SWCLK 10, SWDIO 11. Only with
+// probe.pio, as probe_swd.pio leaves no room for JTAG as well.
+#if !defined(PROBE_SWD_XFER)
+#define PROBE_PORT1_PIN_OFFSET 10
+#endif
+// SWO trace input, captured by PIO
+#define PROBE_PIN_SWO 6
+// JTAG: TCK and TMS are SWCLK and SWDIO, TDO shares a pin with SWO as on
+// the Arm 10-pin debug connector
+#define PROBE_PIN_TCK PROBE_PIN_SWCLK
+#define PROBE_PIN_TMS PROBE_PIN_SWDIO
+#define PROBE_PIN_TDI 7
+#define PROBE_PIN_TDO PROBE_PIN_SWO
 // Target reset config
 #if false
 #define PROBE_PIN_RESET 1
@@ -0,0 +1,386 @@
+#!/usr/bin/env python3
+#
+# Copyright (c) 2023 Raspberry Pi (Trading) Ltd.
+#
+# SPDX-License-Identifier: BSD-3-Clause
+#
+# Replay CMSIS-DAP v2 traffic through a model of the probe's SWD engine, and
+# report commands/s, bytes/s and per-command latency.
+#
+#   dap_bench.py session.pcap                   # a usbmon capture, see dp_cache_bench.py
+#   dap_bench.py --synthetic all                # OpenOCD-like connect, read, write, flash
+#   dap_bench.py --synthetic all --pcap-out s.pcap
+#
+# Each SWD transfer costs the clocks the state machine drives for it:
+# request, turnaround, ACK, data and parity, turnaround, and the configured
+# idle cycles. AP reads are posted, so a run of them ends with a DP RDBUFF
+# read. Every transfer is taken to be ACKed OK at the first attempt.
+#
+# The probe's own time per command and per transfer is not modelled unless
+# given: vendor command 0x82 measures it on hardware. So by default the
+# figures are the wire time alone, the bound that SWCLK sets, with commands
+# back to back as when the host keeps the DAP queue full.
+
+import argparse
+import os
+import struct
+import sys
+
+sys.path.insert(0, os.path.dirname(os.path.abspath(__file__)))
+from dp_cache_bench import (dap_requests, LINKTYPE_USB_LINUX_MMAPPED,  # noqa: E402
+                            USBMON_HEADER, USB_XFER_BULK)
+
+# DAP command IDs
+ID_DAP_INFO = 0x00
+ID_DAP_HOST_STATUS = 0x01
+ID_DAP_CONNECT = 0x02
+ID_DAP_DISCONNECT = 0x03
+ID_DAP_TRANSFER_CONFIGURE = 0x04
+ID_DAP_TRANSFER = 0x05
+ID_DAP_TRANSFER_BLOCK = 0x06
+ID_DAP_WRITE_ABORT = 0x08
+ID_DAP_SWJ_CLOCK = 0x11
+ID_DAP_SWJ_SEQUENCE = 0x12
+ID_DAP_SWD_CONFIGURE = 0x13
+ID_DAP_SWD_SEQUENCE = 0x1d
+ID_DAP_QUEUE_COMMANDS = 0x7e
+ID_DAP_EXECUTE_COMMANDS = 0x7f
+
+NAMES = {
+    ID_DAP_INFO: 'Info', ID_DAP_HOST_STATUS: 'HostStatus', ID_DAP_CONNECT: 'Connect',
+    ID_DAP_DISCONNECT: 'Disconnect', ID_DAP_TRANSFER_CONFIGURE: 'TransferConfigure',
+    ID_DAP_TRANSFER: 'Transfer', ID_DAP_TRANSFER_BLOCK: 'TransferBlock',
+    ID_DAP_WRITE_ABORT: 'WriteABORT', ID_DAP_SWJ_CLOCK: 'SWJ_Clock',
+    ID_DAP_SWJ_SEQUENCE: 'SWJ_Sequence', ID_DAP_SWD_CONFIGURE: 'SWD_Configure',
+    ID_DAP_SWD_SEQUENCE: 'SWD_Sequence', ID_DAP_EXECUTE_COMMANDS: 'ExecuteCommands',
+}
+
+# Transfer request bits
+APnDP = 0x01
+RnW = 0x02
+MATCH_VALUE = 0x10
+MATCH_MASK = 0x20
+REG = APnDP | 0x0c
+
+DP_ABORT = 0x00
+DP_CTRL_STAT = 0x04
+DP_SELECT = 0x08
+DP_RDBUFF = 0x0c
+AP_CSW = APnDP | 0x00
+AP_TAR = APnDP | 0x04
+AP_DRW = APnDP | 0x0c
+AP_IDR_BANK = 0xf0
+
+
+class Engine:
+    """What each command costs on the wire, in SWCLK cycles"""
+
+    def __init__(self):
+        self.turnaround = 1
+        self.idle = 0
+
+    def transfers(self, n):
+        # Request 8, ACK 3, data 32 and parity 1, a turnaround each way
+        return n * (8 + 3 + 33 + 2 * self.turnaround + self.idle)
+
+
+class Cost:
+    def __init__(self, name):
+        self.name = name
+        self.cycles = 0
+        self.transfers = 0
+        self.data = 0
+
+
+class Replay:
+    def __init__(self, engine):
+        self.engine = engine
+        self.costs = []
+        self.unparsed = 0
+
+    def packet(self, data):
+        try:
+            cost = Cost(NAMES.get(data[0], f'0x{data[0]:02x}'))
+            if self.command(data, 0, cost) is None:
+                self.unparsed += 1
+                return
+        except (IndexError, struct.error):
+            self.unparsed += 1
+            return
+        self.costs.append(cost)
+
+    def transfer(self, cost, n, posted):
+        cost.transfers += n
+        cost.cycles += self.engine.transfers(n)
+        # A run of posted AP reads is collected with a DP RDBUFF read
+        if posted:
+            cost.transfers += 1
+            cost.cycles += self.engine.transfers(1)
+
+    def command(self, data, pos, cost):
+        """Add up the command at pos, returning the position after it"""
+        cmd = data[pos]
+        pos += 1
+        if cmd in (ID_DAP_INFO, ID_DAP_CONNECT):
+            return pos + 1
+        if cmd == ID_DAP_HOST_STATUS:
+            return pos + 2
+        if cmd == ID_DAP_DISCONNECT:
+            return pos
+        if cmd == ID_DAP_TRANSFER_CONFIGURE:
+            self.engine.idle = data[pos]
+            return pos + 5
+        if cmd == ID_DAP_SWJ_CLOCK:
+            return pos + 4
+        if cmd == ID_DAP_SWD_CONFIGURE:
+            self.engine.turnaround = (data[pos] & 3) + 1
+            return pos + 1
+        if cmd == ID_DAP_WRITE_ABORT:
+            self.transfer(cost, 1, False)
+            return pos + 5
+        if cmd == ID_DAP_TRANSFER:
+            count = data[pos + 1]
+            pos += 2
+            posted = False
+            for _ in range(count):
+                req = data[pos]
+                pos += 1
+                if not req & RnW or req & MATCH_VALUE:
+                    if not req & RnW and not req & MATCH_MASK and req & REG == AP_DRW:
+                        cost.data += 4
+                    pos += 4
+                elif req & REG == AP_DRW:
+                    cost.data += 4
+                # The posted read is collected by the next AP read, or by RDBUFF
+                if posted and not (req & RnW and req & APnDP):
+                    self.transfer(cost, 0, True)
+                posted = bool(req & RnW and req & APnDP)
+                self.transfer(cost, 1, False)
+            if posted:
+                self.transfer(cost, 0, True)
+            return pos
+        if cmd == ID_DAP_TRANSFER_BLOCK:
+            count, req = struct.unpack_from('<HB', data, pos + 1)
+            pos += 4
+            self.transfer(cost, count, bool(req & RnW and req & APnDP))
+            if req & REG == AP_DRW:
+                cost.data += 4 * count
+            if not req & RnW:
+                pos += 4 * count
+            return pos
+        if cmd == ID_DAP_SWJ_SEQUENCE:
+            count = data[pos] or 256
+            cost.cycles += count
+            return pos + 1 + (count + 7) // 8
+        if cmd == ID_DAP_SWD_SEQUENCE:
+            nseq = data[pos]
+            pos += 1
+            for _ in range(nseq):
+                info = data[pos]
+                pos += 1
+                count = (info & 0x3f) or 64
+                cost.cycles += count
+                if not info & 0x80:
+                    pos += (count + 7) // 8
+            return pos
+        if cmd in (ID_DAP_QUEUE_COMMANDS, ID_DAP_EXECUTE_COMMANDS):
+            cost.name = NAMES[ID_DAP_EXECUTE_COMMANDS]
+            n = data[pos]
+            pos += 1
+            for _ in range(n):
+                pos = self.command(data, pos, cost)
+                if pos is None:
+                    return None
+            return pos
+        # Vendor and SWO commands: no way to tell their length
+        return None
+
+
+class Session:
+    """DAP requests like those OpenOCD sends, split to fit the packet size"""
+
+    def __init__(self, packet_size):
+        self.packet_size = packet_size
+        self.packets = []
+        self.select = None
+
+    def transfer(self, reqs):
+        """reqs: list of (request, value or None)"""
+        pkt = bytearray()
+        reads = 0
+        for req, val in reqs:
+            size = 1 if req & RnW else 5
+            if pkt and (len(pkt) + size > self.packet_size or
+                        3 + 4 * (reads + bool(req & RnW)) > self.packet_size):
+                self.packets.append(bytes(pkt))
+                pkt = bytearray()
+                reads = 0
+            if not pkt:
+                pkt += bytes((ID_DAP_TRANSFER, 0, 0))
+            pkt[2] += 1
+            pkt.append(req)
+            if req & RnW:
+                reads += 1
+            else:
+                pkt += struct.pack('<I', val)
+        if pkt:
+            self.packets.append(bytes(pkt))
+
+    def ap_setup(self, csw, tar, bank=0):
+        # OpenOCD writes SELECT when it changes, and CSW and TAR before each run
+        reqs = []
+        if self.select != bank:
+            reqs.append((DP_SELECT, bank))
+            self.select = bank
+        return reqs + [(AP_CSW, csw), (AP_TAR, tar)]
+
+    def connect(self):
+        self.packets.append(bytes((ID_DAP_CONNECT, 1)))
+        self.packets.append(bytes((ID_DAP_SWD_CONFIGURE, 0)))
+        self.packets.append(bytes((ID_DAP_TRANSFER_CONFIGURE, 0)) + struct.pack('<HH', 64, 0))
+        self.packets.append(bytes((ID_DAP_SWJ_CLOCK,)) + struct.pack('<I', 10000000))
+        # Line reset, JTAG-to-SWD, line reset, idle
+        for count, bits in ((51, (1 << 51) - 1), (16, 0xe79e), (51, (1 << 51) - 1), (8, 0)):
+            self.packets.append(bytes((ID_DAP_SWJ_SEQUENCE, count)) +
+                                bits.to_bytes((count + 7) // 8, 'little'))
+        self.transfer([(RnW, None), (DP_ABORT, 0x1e), (DP_SELECT, 0),
+                       (DP_CTRL_STAT, 0x50000000), (DP_CTRL_STAT | RnW, None)])
+        self.transfer([(DP_SELECT, AP_IDR_BANK), (AP_DRW | RnW, None)])
+        self.select = AP_IDR_BANK
+
+    def block(self, addr, nbytes, write):
+        words = nbytes // 4
+        # Read responses and write requests both carry 4 bytes a word
+        per_packet = (self.packet_size - 5) // 4 if write else (self.packet_size - 4) // 4
+        while words:
+            run = min(words, (0x400 - (addr & 0x3ff)) // 4)
+            self.transfer(self.ap_setup(0xa2000012, addr))
+            left = run
+            while left:
+                n = min(left, per_packet)
+                pkt = struct.pack('<BBHB', ID_DAP_TRANSFER_BLOCK, 0, n, AP_DRW | (0 if write else RnW))
+                if write:
+                    pkt += bytes(4 * n)
+                self.packets.append(pkt)
+                left -= n
+            addr += 4 * run
+            words -= run
+
+    def mem_write(self, addr, val):
+        self.transfer(self.ap_setup(0xa2000002, addr) + [(AP_DRW, val)])
+
+    def mem_read(self, addr):
+        self.transfer(self.ap_setup(0xa2000002, addr) + [(AP_DRW | RnW, None)])
+
+    def flash(self, pages, page_size=256):
+        # Load each page into RAM, set up R0-R2 and PC, run, poll DHCSR until halted
+        dhcsr, dcrsr, dcrdr = 0xe000edf0, 0xe000edf4, 0xe000edf8
+        for page in range(pages):
+            self.block(0x20001000, page_size, True)
+            for reg, val in ((0, 0x10000000 + page * page_size), (1, page_size), (2, 0x20001000),
+                             (15, 0x20000001)):
+                self.mem_write(dcrdr, val)
+                self.mem_write(dcrsr, 0x10000 | reg)
+            self.mem_write(dhcsr, 0xa05f0001)
+            for _ in range(3):
+                self.mem_read(dhcsr)
+
+    def build(self, kind):
+        self.connect()
+        if kind in ('read', 'all'):
+            self.block(0x20000000, 64 * 1024, False)
+        if kind in ('write', 'all'):
+            self.block(0x20000000, 64 * 1024, True)
+        if kind in ('flash', 'all'):
+            self.flash(64)
+        return self.packets
+
+
+def write_pcap(path, packets, ep):
+    """Write packets as bulk OUT submissions in a usbmon pcap"""
+    hdr_len = USBMON_HEADER[LINKTYPE_USB_LINUX_MMAPPED]
+    with open(path, 'wb') as f:
+        f.write(struct.pack('<IHHiIII', 0xa1b2c3d4, 2, 4, 0, 0, 65535, LINKTYPE_USB_LINUX_MMAPPED))
+        for n, payload in enumerate(packets):
+            hdr = struct.pack('<QBBBBHccqiiII', n, ord('S'), USB_XFER_BULK, ep, 1, 1, b'-', b'\0',
+                              n // 1000, (n % 1000) * 1000, -115, len(payload), len(payload))
+            hdr += bytes(hdr_len - len(hdr))
+            rec = hdr + payload
+            f.write(struct.pack('<IIII', n // 1000, (n % 1000) * 1000, len(rec), len(rec)))
+            f.write(rec)
+
+
+def histogram(times):
+    """Counts per power-of-2 µs bucket"""
+    buckets = {}
+    for t in times:
+        b = 1
+        while b < t:
+            b *= 2
+        buckets[b] = buckets.get(b, 0) + 1
+    return sorted(buckets.items())
+
+
+def main():
+    parser = argparse.ArgumentParser(description='Model DAP command throughput from recorded or synthetic traffic')
+    parser.add_argument('pcap', nargs='?', help='usbmon capture in pcap format, as written by tcpdump')
+    parser.add_argument('--synthetic', choices=('connect', 'read', 'write', 'flash', 'all'),
+                        help='replay an OpenOCD-like session: connect, then 64 KiB read, 64 KiB write, '
+                             'and/or 64 flash pages')
+    parser.add_argument('--pcap-out', help='also write the synthetic session as a usbmon pcap')
+    parser.add_argument('--packet-size', type=int, default=64, help='DAP packet size (default 64)')
+    parser.add_argument('--ep', type=lambda x: int(x, 0), default=0x04,
+                        help='DAP bulk OUT endpoint (default 0x04)')
+    parser.add_argument('--dev', type=int, help='USB device address of the probe')
+    parser.add_argument('--swclk', type=float, default=10000, help='SWCLK in kHz (default 10000)')
+    parser.add_argument('--cmd-us', type=float, default=0,
+                        help='probe time per DAP command in µs, on top of the wire (default 0)')
+    parser.add_argument('--xfer-us', type=float, default=0,
+                        help='probe time per SWD transfer in µs, on top of the wire (default 0)')
+    opts = parser.parse_args()
+
+    if opts.synthetic:
+        packets = Session(opts.packet_size).build(opts.synthetic)
+        if opts.pcap_out:
+            write_pcap(opts.pcap_out, packets, opts.ep)
+    elif opts.pcap:
+        packets = dap_requests(opts.pcap, opts.ep, opts.dev)
+    else:
+        parser.error('give a pcap file or --synthetic')
+
+    replay = Replay(Engine())
+    for payload in packets:
+        replay.packet(payload)
+    if not replay.costs:
+        print('No DAP commands found')
+        return 1
+
+    per_cmd = {}
+    total_us = 0
+    total_data = 0
+    total_xfers = 0
+    for cost in replay.costs:
+        us = opts.cmd_us + cost.transfers * opts.xfer_us + cost.cycles * 1000 / opts.swclk
+        per_cmd.setdefault(cost.name, []).append(us)
+        total_us += us
+        total_data += cost.data
+        total_xfers += cost.transfers
+
+    print(f'SWCLK {opts.swclk:g} kHz, {opts.cmd_us:g} us/command, {opts.xfer_us:g} us/transfer')
+    print(f'DAP commands:  {len(replay.costs)} ({replay.unparsed} packets not followed)')
+    print(f'SWD transfers: {total_xfers}')
+    print(f'Total time:    {total_us / 1000:.1f} ms')
+    print(f'Commands/s:    {len(replay.costs) * 1e6 / total_us:.0f}')
+    print(f'Bytes/s:       {total_data * 1e6 / total_us:.0f} ({total_data} bytes of DRW data)')
+    print()
+    print('Latency per command, count per bucket of up to N us:')
+    for name, times in sorted(per_cmd.items()):
+        times.sort()
+        print(f'  {name:18s} n={len(times):<6d} min {times[0]:.1f}  median {times[len(times) // 2]:.1f}  '
+              f'max {times[-1]:.1f}')
+        print('    ' + '  '.join(f'<={b}:{n}' for b, n in histogram(times)))
+    return 0
+
+
+if __name__ == '__main__':
+    sys.exit(main())
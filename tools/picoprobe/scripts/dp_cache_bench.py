@@ -0,0 +1,383 @@
+#!/usr/bin/env python3
+#
+# Copyright (c) 2023 Raspberry Pi (Trading) Ltd.
+#
+# SPDX-License-Identifier: BSD-3-Clause
+#
+# Replay recorded CMSIS-DAP v2 traffic through a model of the probe's DP
+# write cache (PROBE_DP_CACHE), and count the SWD writes it would drop.
+#
+#   sudo modprobe usbmon
+#   sudo tcpdump -i usbmon1 -w session.pcap     # while OpenOCD runs
+#   dp_cache_bench.py session.pcap
+#
+# Only the host's DAP requests are looked at, so every transfer is taken to
+# succeed, a DPIDR read to find an ADIv5 DP and an AP IDR read a MEM-AP.
+# Record a session without WAITs or FAULTs for figures that match the
+# probe's own count (vendor command 0x83).
+
+import argparse
+import struct
+import sys
+
+# DAP command IDs
+ID_DAP_CONNECT = 0x02
+ID_DAP_TRANSFER = 0x05
+ID_DAP_TRANSFER_BLOCK = 0x06
+ID_DAP_SWJ_SEQUENCE = 0x12
+ID_DAP_SWD_SEQUENCE = 0x1d
+ID_DAP_QUEUE_COMMANDS = 0x7e
+ID_DAP_EXECUTE_COMMANDS = 0x7f
+ID_DAP_VENDOR_SELECT_PORT = 0x86
+ID_DAP_VENDOR_SELECT_TARGET = 0x87
+
+# Transfer request bits
+APnDP = 0x01
+RnW = 0x02
+MATCH_VALUE = 0x10
+MATCH_MASK = 0x20
+REG = APnDP | 0x0c
+
+DP_ABORT = 0x00
+DP_DPIDR = 0x00
+DP_SELECT = 0x08
+DP_RDBUFF = 0x0c
+DP_TARGETSEL = 0x0c
+AP_CSW = APnDP | 0x00
+AP_TAR = APnDP | 0x04
+AP_DRW = APnDP | 0x0c
+AP_IDR = APnDP | 0x0c   # In bank 0xf
+
+# TARGETSEL request packet
+TARGETSEL_REQUEST = 0x99
+
+# Same as sw_dp_pio.c
+SWD_TARGETS = 4
+
+# pcap link types for Linux usbmon, and their header sizes
+LINKTYPE_USB_LINUX = 189
+LINKTYPE_USB_LINUX_MMAPPED = 220
+USBMON_HEADER = {LINKTYPE_USB_LINUX: 48, LINKTYPE_USB_LINUX_MMAPPED: 64}
+USB_XFER_BULK = 3
+
+
+class Target:
+    """What the probe knows of one target's DP and MEM-AP"""
+
+    def __init__(self, targetsel=None):
+        self.targetsel = targetsel
+        # Kept until a connect or a change of target
+        self.adiv5 = False
+        self.mem_aps = set()
+        self.forget()
+
+    def forget(self):
+        # No AP access is posted, so a dropped write can't hide a FAULT
+        self.synced = False
+        self.select = None
+        self.csw = None
+        self.csw_select = None
+        self.tar = None
+
+    def ap_tracked(self):
+        return (self.select is not None and self.csw is not None and
+                self.csw_select == self.select & ~0xf and
+                self.adiv5 and self.csw_select >> 24 in self.mem_aps)
+
+
+class Cache:
+    """Model of the per-target state in sw_dp_pio.c"""
+
+    def __init__(self):
+        self.ports = {}
+        self.port = 0
+        self.transfers = 0
+        self.dropped = {DP_SELECT: 0, AP_CSW: 0, AP_TAR: 0}
+        # As in DAP.c's DAP_Transfer
+        self.post_read = False
+        self.check_write = False
+        self.select_port(0)
+
+    def select_port(self, port):
+        self.port = port
+        if port not in self.ports:
+            self.ports[port] = {'targets': [], 'next': 0, 'anon': Target()}
+            self.target = self.ports[port]['anon']
+            self.ports[port]['cur'] = self.target
+        self.target = self.ports[port]['cur']
+
+    def set_target(self, target):
+        self.target = target
+        self.ports[self.port]['cur'] = target
+
+    def forget_all(self):
+        state = self.ports[self.port]
+        state['targets'] = []
+        state['next'] = 0
+        self.detach()
+
+    def detach(self):
+        anon = Target()
+        self.ports[self.port]['anon'] = anon
+        self.set_target(anon)
+
+    def targetsel(self, value):
+        state = self.ports[self.port]
+        for t in state['targets']:
+            if t.targetsel == value:
+                self.set_target(t)
+                return
+        t = Target(value)
+        if len(state['targets']) < SWD_TARGETS:
+            state['targets'].append(t)
+        else:
+            state['targets'][state['next']] = t
+            state['next'] = (state['next'] + 1) % SWD_TARGETS
+        self.set_target(t)
+
+    def sequence(self, count, data):
+        """Anything but a single run of ones may hide a TARGETSEL"""
+        edges = 0
+        last = 0
+        for n in range(count):
+            bit = (data[n // 8] >> (n % 8)) & 1
+            if bit != last:
+                edges += 1
+                last = bit
+        if edges > 2:
+            self.detach()
+
+    def rdbuff(self):
+        """The RDBUFF read DAP.c adds to collect a posted read or check a write"""
+        self.target.synced = True
+        self.post_read = False
+        self.check_write = False
+
+    def end(self):
+        """End of a DAP transfer command"""
+        if self.post_read or self.check_write:
+            self.rdbuff()
+
+    def posted(self, req):
+        t = self.target
+        reg = req & REG
+        if req & APnDP:
+            t.synced = False
+        elif (reg == DP_RDBUFF) if req & RnW else (reg != DP_ABORT):
+            t.synced = True
+
+    def write(self, req, value):
+        t = self.target
+        reg = req & REG
+        if reg == DP_TARGETSEL and not req & APnDP:
+            self.targetsel(value)
+            return
+        if self.post_read:
+            self.rdbuff()
+        self.check_write = True
+        self.transfers += 1
+        if t.synced and ((reg == DP_SELECT and t.select == value) or
+                         (reg == AP_CSW and t.ap_tracked() and t.csw == value) or
+                         (reg == AP_TAR and t.ap_tracked() and t.tar == value)):
+            self.dropped[reg] += 1
+            return
+        self.posted(req)
+        if reg == DP_ABORT:
+            t.forget()
+        elif reg == DP_SELECT:
+            t.select = value
+        elif reg == AP_CSW:
+            if t.select is not None and not t.select & 0xf0:
+                if not t.ap_tracked():
+                    t.tar = None
+                t.csw = value
+                t.csw_select = t.select & ~0xf
+        elif reg == AP_TAR:
+            if t.ap_tracked():
+                t.tar = value
+        self.drw(reg)
+
+    def read(self, req):
+        t = self.target
+        reg = req & REG
+        if self.post_read and not req & APnDP:
+            self.rdbuff()
+        self.post_read = bool(req & APnDP)
+        self.check_write = False
+        self.transfers += 1
+        self.posted(req)
+        if reg == DP_DPIDR and (t.select is None or not t.select & 0xf):
+            t.adiv5 = True
+        elif reg == AP_IDR and t.select is not None and t.select & 0xf0 == 0xf0:
+            t.mem_aps.add(t.select >> 24)
+        self.drw(reg)
+
+    def drw(self, reg):
+        t = self.target
+        if reg != AP_DRW or not t.ap_tracked() or t.tar is None:
+            return
+        addr_inc = (t.csw >> 4) & 3
+        size = t.csw & 7
+        if addr_inc == 0:
+            return
+        tar = (t.tar + (1 << size)) & 0xffffffff
+        if addr_inc == 1 and size <= 2 and not (tar ^ t.tar) & ~0x3ff:
+            t.tar = tar
+        else:
+            t.tar = None
+
+
+class Replay:
+    def __init__(self):
+        self.cache = Cache()
+        self.commands = 0
+        self.unparsed = 0
+        self.targetsel_seq = 0
+
+    def packet(self, data):
+        try:
+            self.command(data, 0)
+        except (IndexError, struct.error):
+            self.unparsed += 1
+
+    def command(self, data, pos):
+        """Replay the command at pos, returning the position after it"""
+        cmd = data[pos]
+        pos += 1
+        self.commands += 1
+        if cmd == ID_DAP_CONNECT:
+            self.cache.forget_all()
+            return pos + 1
+        if cmd == ID_DAP_TRANSFER:
+            count = data[pos + 1]
+            pos += 2
+            for _ in range(count):
+                req = data[pos]
+                pos += 1
+                if req & RnW:
+                    if req & MATCH_VALUE:
+                        pos += 4
+                    self.cache.read(req)
+                elif req & MATCH_MASK:
+                    pos += 4
+                else:
+                    value, = struct.unpack_from('<I', data, pos)
+                    pos += 4
+                    self.cache.write(req, value)
+            self.cache.end()
+            return pos
+        if cmd == ID_DAP_TRANSFER_BLOCK:
+            count, req = struct.unpack_from('<HB', data, pos + 1)
+            pos += 4
+            for _ in range(count):
+                if req & RnW:
+                    self.cache.read(req)
+                else:
+                    value, = struct.unpack_from('<I', data, pos)
+                    pos += 4
+                    self.cache.write(req, value)
+            self.cache.end()
+            return pos
+        if cmd == ID_DAP_SWJ_SEQUENCE:
+            count = data[pos] or 256
+            self.cache.sequence(count, data[pos + 1:])
+            return pos + 1 + (count + 7) // 8
+        if cmd == ID_DAP_SWD_SEQUENCE:
+            nseq = data[pos]
+            pos += 1
+            for _ in range(nseq):
+                info = data[pos]
+                pos += 1
+                count = (info & 0x3f) or 64
+                if info & 0x80:
+                    self.targetsel_seq = 2 if self.targetsel_seq == 1 else 0
+                    continue
+                out = data[pos:pos + (count + 7) // 8]
+                pos += (count + 7) // 8
+                if count == 8 and out[0] == TARGETSEL_REQUEST:
+                    self.targetsel_seq = 1
+                elif self.targetsel_seq == 2 and count >= 33:
+                    self.cache.targetsel(struct.unpack_from('<I', out)[0])
+                    self.targetsel_seq = 0
+                else:
+                    if self.targetsel_seq:
+                        self.cache.detach()
+                    self.cache.sequence(count, out)
+                    self.targetsel_seq = 0
+            return pos
+        if cmd in (ID_DAP_QUEUE_COMMANDS, ID_DAP_EXECUTE_COMMANDS):
+            n = data[pos]
+            pos += 1
+            for _ in range(n):
+                pos = self.command(data, pos)
+                if pos is None:
+                    raise IndexError
+            return pos
+        if cmd == ID_DAP_VENDOR_SELECT_PORT:
+            self.cache.select_port(data[pos])
+            return pos + 1
+        if cmd == ID_DAP_VENDOR_SELECT_TARGET:
+            self.cache.targetsel(struct.unpack_from('<I', data, pos)[0])
+            self.cache.read(RnW)
+            return pos + 4
+        # Nothing else touches the DP, but its length isn't known either
+        return None
+
+
+def dap_requests(path, ep, dev):
+    """Payloads of the bulk OUT transfers to the DAP endpoint in a usbmon pcap"""
+    with open(path, 'rb') as f:
+        data = f.read()
+    magic, = struct.unpack_from('<I', data, 0)
+    if magic == 0xa1b2c3d4 or magic == 0xa1b23c4d:
+        endian = '<'
+    elif magic == 0xd4c3b2a1 or magic == 0x4d3cb2a1:
+        endian = '>'
+    else:
+        raise ValueError(f'{path} is not a pcap file (pcapng is not supported)')
+    linktype, = struct.unpack_from(endian + 'I', data, 20)
+    if linktype not in USBMON_HEADER:
+        raise ValueError(f'{path} is not a usbmon capture')
+    hdr_len = USBMON_HEADER[linktype]
+    pos = 24
+    while pos + 16 <= len(data):
+        _, _, caplen, _ = struct.unpack_from(endian + 'IIII', data, pos)
+        pos += 16
+        rec = data[pos:pos + caplen]
+        pos += caplen
+        # usbmon headers are in host byte order, which is the capture's
+        (_, ev, xfer, epnum, devnum, _, _, _, _, _, _, _, len_cap) = struct.unpack_from(
+            endian + 'QBBBBHccqiiII', rec, 0)
+        if (ev != ord('S') or xfer != USB_XFER_BULK or epnum != ep or
+                (dev is not None and devnum != dev)):
+            continue
+        payload = rec[hdr_len:hdr_len + len_cap]
+        if payload:
+            yield payload
+
+
+def main():
+    parser = argparse.ArgumentParser(description='Count the SWD writes the DP cache would drop from recorded DAP traffic')
+    parser.add_argument('pcap', help='usbmon capture in pcap format, as written by tcpdump')
+    parser.add_argument('--ep', type=lambda x: int(x, 0), default=0x04,
+                        help='DAP bulk OUT endpoint (default 0x04)')
+    parser.add_argument('--dev', type=int, help='USB device address of the probe')
+    opts = parser.parse_args()
+
+    replay = Replay()
+    for payload in dap_requests(opts.pcap, opts.ep, opts.dev):
+        replay.packet(payload)
+
+    cache = replay.cache
+    dropped = sum(cache.dropped.values())
+    print(f'DAP commands:    {replay.commands} ({replay.unparsed} packets not followed)')
+    print(f'SWD transfers:   {cache.transfers}')
+    for reg, name in ((DP_SELECT, 'DP SELECT'), (AP_CSW, 'AP CSW'), (AP_TAR, 'AP TAR')):
+        print(f'  dropped {name + ":":11s}{cache.dropped[reg]}')
+    if cache.transfers:
+        print(f'Sent with cache: {cache.transfers - dropped} ({100.0 * dropped / cache.transfers:.1f}% fewer)')
+    return 0
+
+
+if __name__ == '__main__':
+    sys.exit(main())
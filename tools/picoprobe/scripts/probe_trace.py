@@ -0,0 +1,147 @@
+#!/usr/bin/env python3
+#
+# Copyright (c) 2023 Raspberry Pi (Trading) Ltd.
+#
+# SPDX-License-Identifier: BSD-3-Clause
+#
+# Decode the binary trace log of a PROBE_TRACE build of debugprobe.
+#
+#   probe_trace.py build/debugprobe.elf /dev/ttyACM1
+#
+# The probe sends the address of each probe_info()/probe_debug() format string
+# and its raw arguments. The strings themselves, and any %s arguments, are
+# looked up in the ELF the probe is running.
+
+import argparse
+import os
+import re
+import struct
+import sys
+import termios
+import tty
+
+TRACE_REC = 0xa0
+TRACE_LOST = 0xb0
+TRACE_MAX_ARGS = 4
+
+SHT_PROGBITS = 1
+SHF_ALLOC = 2
+
+
+class Elf:
+    """Just enough ELF32 to read bytes at a target address"""
+
+    def __init__(self, path):
+        with open(path, 'rb') as f:
+            self.data = f.read()
+        if self.data[:4] != b'\x7fELF' or self.data[4] != 1:
+            raise ValueError(f'{path} is not a 32-bit ELF file')
+        shoff, = struct.unpack_from('<I', self.data, 0x20)
+        shentsize, shnum = struct.unpack_from('<HH', self.data, 0x2e)
+        self.sections = []
+        for i in range(shnum):
+            (_, sh_type, flags, addr, offset, size) = struct.unpack_from(
+                '<IIIIII', self.data, shoff + i * shentsize)
+            if sh_type == SHT_PROGBITS and flags & SHF_ALLOC and size:
+                self.sections.append((addr, offset, size))
+
+    def string(self, addr):
+        for (start, offset, size) in self.sections:
+            if start <= addr < start + size:
+                pos = offset + addr - start
+                end = self.data.find(b'\0', pos, offset + size)
+                if end < 0:
+                    return None
+                return self.data[pos:end].decode('ascii', 'replace')
+        return None
+
+
+SPEC = re.compile(r'%([-+ #0]*\d*(?:\.\d+)?)(?:hh|h|ll|l|z|j|t)?([diouxXcsp%])')
+
+
+def render(elf, fmt, args):
+    args = iter(args)
+
+    def conv(m):
+        flags, kind = m.groups()
+        if kind == '%':
+            return '%'
+        value = next(args, 0)
+        if kind in 'di':
+            if value & 0x80000000:
+                value -= 1 << 32
+            return ('%' + flags + 'd') % value
+        if kind in 'ouxX':
+            return ('%' + flags + kind) % value
+        if kind == 'c':
+            return chr(value & 0xff)
+        if kind == 's':
+            s = elf.string(value)
+            return ('%' + flags + 's') % (s if s is not None else f'<0x{value:08x}>')
+        return f'0x{value:08x}'
+
+    return SPEC.sub(conv, fmt)
+
+
+def decode(elf, stream, out):
+    buf = b''
+    last = {}
+    while True:
+        chunk = stream.read(4096)
+        if not chunk:
+            break
+        buf += chunk
+        while buf:
+            head = buf[0]
+            core = (head >> 3) & 1
+            if head & 0xf0 == TRACE_LOST and not head & 0x07:
+                if len(buf) < 5:
+                    break
+                lost, = struct.unpack_from('<I', buf, 1)
+                out.write(f'[{core}] ... {lost} records lost\n')
+                buf = buf[5:]
+                continue
+            nargs = head & 0x07
+            if head & 0xf0 != TRACE_REC or nargs > TRACE_MAX_ARGS:
+                buf = buf[1:]
+                continue
+            size = 9 + 4 * nargs
+            if len(buf) < size:
+                break
+            fmt_addr, time_us, *args = struct.unpack_from('<II' + 'I' * nargs, buf, 1)
+            fmt = elf.string(fmt_addr)
+            if fmt is None:
+                # Not a record boundary after all, resynchronise
+                buf = buf[1:]
+                continue
+            buf = buf[size:]
+            delta = (time_us - last.get(core, time_us)) & 0xffffffff
+            last[core] = time_us
+            text = render(elf, fmt, args).rstrip('\n')
+            out.write(f'[{core}] {time_us:10d} +{delta:<7d} {text}\n')
+        out.flush()
+
+
+def main():
+    parser = argparse.ArgumentParser(description='Decode the debugprobe binary trace log')
+    parser.add_argument('elf', help='ELF file of the firmware running on the probe')
+    parser.add_argument('input', help="the probe's trace CDC port, a capture of it, or - for stdin")
+    opts = parser.parse_args()
+
+    elf = Elf(opts.elf)
+    if opts.input == '-':
+        stream = sys.stdin.buffer.raw
+    else:
+        fd = os.open(opts.input, os.O_RDONLY)
+        if os.isatty(fd):
+            tty.setraw(fd)
+            termios.tcflush(fd, termios.TCIFLUSH)
+        stream = os.fdopen(fd, 'rb', buffering=0)
+    try:
+        decode(elf, stream, sys.stdout)
+    except KeyboardInterrupt:
+        pass
+
+
+if __name__ == '__main__':
+    main()
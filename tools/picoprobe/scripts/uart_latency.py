@@ -0,0 +1,96 @@
+#!/usr/bin/env python3
+#
+# Copyright (c) 2023 Raspberry Pi (Trading) Ltd.
+#
+# SPDX-License-Identifier: BSD-3-Clause
+#
+# Measure round-trip latency and jitter through the probe's UART bridge.
+#
+#   uart_latency.py /dev/ttyACM0 --baud 115200 --count 1000
+#
+# Connect the probe's UART TX to its own RX (or to a target that echoes),
+# then each message goes host -> USB -> UART -> USB -> host. Compare the
+# spread of the results between firmware builds, with the same host, hub
+# and baud rate.
+
+import argparse
+import os
+import select
+import statistics
+import sys
+import termios
+import time
+import tty
+
+
+def open_port(path, baud):
+    fd = os.open(path, os.O_RDWR | os.O_NOCTTY)
+    tty.setraw(fd)
+    attr = termios.tcgetattr(fd)
+    speed = getattr(termios, f'B{baud}', None)
+    if speed is None:
+        raise ValueError(f'{baud} is not a standard baud rate')
+    attr[4] = attr[5] = speed
+    termios.tcsetattr(fd, termios.TCSANOW, attr)
+    termios.tcflush(fd, termios.TCIOFLUSH)
+    return fd
+
+
+def round_trip(fd, msg, timeout):
+    """Send msg and wait for it to come back, returning the time taken in µs"""
+    got = b''
+    start = time.perf_counter()
+    os.write(fd, msg)
+    deadline = start + timeout
+    while len(got) < len(msg):
+        left = deadline - time.perf_counter()
+        if left <= 0 or not select.select([fd], [], [], left)[0]:
+            return None
+        got += os.read(fd, len(msg) - len(got))
+    end = time.perf_counter()
+    if got != msg:
+        return None
+    return (end - start) * 1e6
+
+
+def main():
+    parser = argparse.ArgumentParser(description='Measure UART bridge round-trip latency with TX looped back to RX')
+    parser.add_argument('port', help="the probe's UART CDC port")
+    parser.add_argument('--baud', type=int, default=115200, help='UART baud rate (default 115200)')
+    parser.add_argument('--count', type=int, default=1000, help='number of round trips (default 1000)')
+    parser.add_argument('--size', type=int, default=8, help='bytes per message (default 8)')
+    parser.add_argument('--gap', type=float, default=2.0,
+                        help='ms to wait between messages, so that each finds the bridge idle (default 2)')
+    opts = parser.parse_args()
+
+    fd = open_port(opts.port, opts.baud)
+    # Time on the wire alone, 10 bits a byte
+    wire_us = opts.size * 10 * 1e6 / opts.baud
+    times = []
+    lost = 0
+    for n in range(opts.count):
+        msg = bytes((n + i) & 0xff for i in range(opts.size))
+        t = round_trip(fd, msg, 1.0)
+        if t is None:
+            lost += 1
+            termios.tcflush(fd, termios.TCIOFLUSH)
+        else:
+            times.append(t)
+        time.sleep(opts.gap / 1000)
+    os.close(fd)
+
+    if not times:
+        print('No messages came back - is TX connected to RX?')
+        return 1
+    times.sort()
+    p99 = times[min(len(times) - 1, int(len(times) * 0.99))]
+    print(f'Round trips:  {len(times)} ({lost} lost)')
+    print(f'On the wire:  {wire_us:.0f} us')
+    print(f'Latency us:   min {times[0]:.0f}  median {statistics.median(times):.0f}  '
+          f'p99 {p99:.0f}  max {times[-1]:.0f}')
+    print(f'Jitter us:    stdev {statistics.pstdev(times):.0f}  p99 - min {p99 - times[0]:.0f}')
+    return 0
+
+
+if __name__ == '__main__':
+    sys.exit(main())
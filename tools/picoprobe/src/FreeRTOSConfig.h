@@ -42,10 +42,14 @@
 
 /* Scheduler Related */
 #define configUSE_PREEMPTION                    1
-#define configUSE_TICKLESS_IDLE                 0
+/*
+ * Tasks are woken by USB, UART, DMA and DAP events rather than by polling, so
+ * the tick only times delays. The idle task stops it while nothing is due.
+ */
+#define configUSE_TICKLESS_IDLE                 1
 #define configUSE_IDLE_HOOK                     0
-#define configUSE_TICK_HOOK                     1
-#define configTICK_RATE_HZ                      ( ( TickType_t ) 20000 )
+#define configUSE_TICK_HOOK                     0
+#define configTICK_RATE_HZ                      ( ( TickType_t ) 1000 )
 #define configMAX_PRIORITIES                    32
 #define configMINIMAL_STACK_SIZE                ( configSTACK_DEPTH_TYPE ) 256
 #define configUSE_16_BIT_TICKS                  0
@@ -69,8 +73,14 @@
 #define configMESSAGE_BUFFER_LENGTH_TYPE        size_t
 
 /* Memory allocation related definitions. */
+#if defined(PROBE_STATIC_ALLOC)
+/* Task stacks and TCBs are sized at build time, and there is no heap */
+#define configSUPPORT_STATIC_ALLOCATION         1
+#define configSUPPORT_DYNAMIC_ALLOCATION        0
+#else
 #define configSUPPORT_STATIC_ALLOCATION         0
 #define configSUPPORT_DYNAMIC_ALLOCATION        1
+#endif
 #define configTOTAL_HEAP_SIZE                   (64*1024)
 #define configAPPLICATION_ALLOCATED_HEAP        0
 
@@ -80,7 +90,9 @@
 #define configUSE_DAEMON_TASK_STARTUP_HOOK      0
 
 /* Run time and task stats gathering related definitions. */
-#define configGENERATE_RUN_TIME_STATS           0
+#define configGENERATE_RUN_TIME_STATS           1
+#define portCONFIGURE_TIMER_FOR_RUN_TIME_STATS()
+#define portGET_RUN_TIME_COUNTER_VALUE()        time_us_32()
 #define configUSE_TRACE_FACILITY                1
 #define configUSE_STATS_FORMATTING_FUNCTIONS    0
 
@@ -111,6 +123,7 @@
 #define configSUPPORT_PICO_TIME_INTEROP         1
 
 #include <assert.h>
+#include <hardware/timer.h>
 /* Define to trap errors during development. */
 #define configASSERT(x)                         assert(x)
 
@@ -132,6 +145,7 @@ to exclude the API function. */
 #define INCLUDE_xTaskGetHandle                  1
 #define INCLUDE_xTaskResumeFromISR              1
 #define INCLUDE_xQueueGetMutexHolder            1
+#define INCLUDE_xTimerGetTimerDaemonTaskHandle  1
 
 /* A header file that defines trace macro can be included here. */
 
@@ -24,19 +24,46 @@
  */
 
 #include <pico/stdlib.h>
+#include <hardware/dma.h>
+#include <hardware/irq.h>
 #include "FreeRTOS.h"
 #include "task.h"
 
 #include "tusb.h"
 
 #include "probe_config.h"
+#include "cdc_uart.h"
 
 TaskHandle_t uart_taskhandle;
-TickType_t last_wake, interval = 100;
+TickType_t interval = pdMS_TO_TICKS(5);
+
+/*
+ * The UART is serviced by DMA in both directions. RX free-runs into a ring
+ * that cdc_task() drains straight into the CDC FIFO. TX is filled straight
+ * from the CDC FIFO, and each pending stretch is handed to DMA in one go.
+ * Ring sizes must be powers of 2 no larger than 32K, for DMA ring wrapping.
+ * Head and tail are free-running byte counts.
+ */
+#ifndef CDC_UART_RX_RING_BITS
+#define CDC_UART_RX_RING_BITS 13
+#endif
+#ifndef CDC_UART_TX_RING_BITS
+#define CDC_UART_TX_RING_BITS 12
+#endif
+#define RX_RING_SIZE (1u << CDC_UART_RX_RING_BITS)
+#define TX_RING_SIZE (1u << CDC_UART_TX_RING_BITS)
+
+static uint8_t rx_ring[RX_RING_SIZE] __attribute__((aligned(RX_RING_SIZE)));
+static uint8_t tx_ring[TX_RING_SIZE] __attribute__((aligned(TX_RING_SIZE)));
+static uint rx_dma, tx_dma;
+static uint32_t rx_head_base, rx_tail;
+static uint32_t tx_head, tx_tail, tx_inflight;
+/* RX DMA parked, the UART interrupt will wake us on the next byte */
+static volatile bool rx_idle;
+static uint32_t rx_last_head;
+
+struct cdc_uart_stats cdc_uart_stats;
 
-/* Max 1 FIFO worth of data */
-static uint8_t tx_buf[32];
-static uint8_t rx_buf[32];
 // Actually s^-1 so 25ms
 #define DEBOUNCE_MS 40
 static uint debounce_ticks = 5;
@@ -49,6 +76,95 @@ static uint tx_led_debounce;
 static uint rx_led_debounce;
 #endif
 
+/* Bytes the RX DMA has written so far */
+static inline uint32_t cdc_uart_rx_head(void) {
+    return rx_head_base - dma_channel_hw_addr(rx_dma)->transfer_count;
+}
+
+/* (Re)start the RX DMA where it left off. A full count lasts hours even at
+ * several Mbaud, cdc_task() rearms it if it ever runs out. */
+static void cdc_uart_rx_arm(void) {
+    uint32_t head = cdc_uart_rx_head();
+
+    rx_head_base = head + 0xffffffffu;
+    dma_channel_set_write_addr(rx_dma, &rx_ring[head & (RX_RING_SIZE - 1)], false);
+    dma_channel_set_trans_count(rx_dma, 0xffffffffu, true);
+}
+
+static inline void cdc_uart_wake_from_isr(void) {
+    BaseType_t woken = pdFALSE;
+
+    if (uart_taskhandle) {
+        vTaskNotifyGiveFromISR(uart_taskhandle, &woken);
+        portYIELD_FROM_ISR(woken);
+    }
+}
+
+/* First data after an idle spell: hand the FIFO back to DMA */
+static void cdc_uart_irq(void) {
+    uart_hw_t *hw = uart_get_hw(PROBE_UART_INTERFACE);
+
+    hw_clear_bits(&hw->imsc, UART_UARTIMSC_RXIM_BITS | UART_UARTIMSC_RTIM_BITS);
+    hw->icr = UART_UARTICR_RXIC_BITS | UART_UARTICR_RTIC_BITS;
+    hw_set_bits(&hw->dmacr, UART_UARTDMACR_RXDMAE_BITS);
+    rx_idle = false;
+    cdc_uart_wake_from_isr();
+}
+
+/* A TX DMA burst has finished, there may be more to send */
+static void cdc_uart_dma_irq(void) {
+    if (dma_channel_get_irq1_status(tx_dma)) {
+        dma_channel_acknowledge_irq1(tx_dma);
+        cdc_uart_wake_from_isr();
+    }
+}
+
+/* Stop DMA from draining the RX FIFO so its level and timeout interrupts
+ * can tell us when data turns up. Anything already in the FIFO stays there
+ * and raises the interrupt in turn. */
+static void cdc_uart_rx_park(void) {
+    uart_hw_t *hw = uart_get_hw(PROBE_UART_INTERFACE);
+
+    rx_idle = true;
+    hw_clear_bits(&hw->dmacr, UART_UARTDMACR_RXDMAE_BITS);
+    hw->icr = UART_UARTICR_RXIC_BITS | UART_UARTICR_RTIC_BITS;
+    hw_set_bits(&hw->imsc, UART_UARTIMSC_RXIM_BITS | UART_UARTIMSC_RTIM_BITS);
+}
+
+/* uart_init() leaves RX DMA enabled and the interrupts masked */
+static void cdc_uart_rx_setup(void) {
+    uart_hw_t *hw = uart_get_hw(PROBE_UART_INTERFACE);
+
+    rx_idle = false;
+    hw_write_masked(&hw->ifls, 0 << UART_UARTIFLS_RXIFLSEL_LSB, UART_UARTIFLS_RXIFLSEL_BITS);
+}
+
+/* Abandon any UART TX in progress, e.g. across a line coding change */
+static void cdc_uart_tx_reset(void) {
+    dma_channel_abort(tx_dma);
+    tx_head = tx_tail = tx_inflight = 0;
+}
+
+/* Collect latched UART receive errors. With DMA reading DR the per-byte
+ * error flags are lost, so use the raw interrupt status instead. */
+static void cdc_uart_poll_errors(void) {
+    uart_hw_t *hw = uart_get_hw(PROBE_UART_INTERFACE);
+    uint32_t ris = hw->ris & (UART_UARTRIS_OERIS_BITS | UART_UARTRIS_BERIS_BITS |
+                              UART_UARTRIS_PERIS_BITS | UART_UARTRIS_FERIS_BITS);
+
+    if (!ris)
+        return;
+    if (ris & UART_UARTRIS_OERIS_BITS)
+        cdc_uart_stats.uart_overrun++;
+    if (ris & UART_UARTRIS_BERIS_BITS)
+        cdc_uart_stats.uart_break++;
+    if (ris & UART_UARTRIS_PERIS_BITS)
+        cdc_uart_stats.uart_parity++;
+    if (ris & UART_UARTRIS_FERIS_BITS)
+        cdc_uart_stats.uart_framing++;
+    hw->icr = ris;
+}
+
 void cdc_uart_init(void) {
     gpio_set_function(PROBE_UART_TX, GPIO_FUNC_UART);
     gpio_set_function(PROBE_UART_RX, GPIO_FUNC_UART);
@@ -56,6 +172,33 @@ void cdc_uart_init(void) {
     gpio_set_pulls(PROBE_UART_RX, 1, 0);
     uart_init(PROBE_UART_INTERFACE, PROBE_UART_BAUDRATE);
 
+    dma_channel_config c;
+    rx_dma = dma_claim_unused_channel(true);
+    c = dma_channel_get_default_config(rx_dma);
+    channel_config_set_transfer_data_size(&c, DMA_SIZE_8);
+    channel_config_set_read_increment(&c, false);
+    channel_config_set_write_increment(&c, true);
+    channel_config_set_ring(&c, true, CDC_UART_RX_RING_BITS);
+    channel_config_set_dreq(&c, uart_get_dreq(PROBE_UART_INTERFACE, false));
+    dma_channel_configure(rx_dma, &c, rx_ring, &uart_get_hw(PROBE_UART_INTERFACE)->dr, 0, false);
+    cdc_uart_rx_arm();
+
+    tx_dma = dma_claim_unused_channel(true);
+    c = dma_channel_get_default_config(tx_dma);
+    channel_config_set_transfer_data_size(&c, DMA_SIZE_8);
+    channel_config_set_read_increment(&c, true);
+    channel_config_set_write_increment(&c, false);
+    channel_config_set_ring(&c, false, CDC_UART_TX_RING_BITS);
+    channel_config_set_dreq(&c, uart_get_dreq(PROBE_UART_INTERFACE, true));
+    dma_channel_configure(tx_dma, &c, &uart_get_hw(PROBE_UART_INTERFACE)->dr, tx_ring, 0, false);
+
+    cdc_uart_rx_setup();
+    irq_set_exclusive_handler(UART0_IRQ + uart_get_index(PROBE_UART_INTERFACE), cdc_uart_irq);
+    irq_set_enabled(UART0_IRQ + uart_get_index(PROBE_UART_INTERFACE), true);
+    dma_channel_set_irq1_enabled(tx_dma, true);
+    irq_add_shared_handler(DMA_IRQ_1, cdc_uart_dma_irq, PICO_SHARED_IRQ_HANDLER_DEFAULT_ORDER_PRIORITY);
+    irq_set_enabled(DMA_IRQ_1, true);
+
 #ifdef PROBE_UART_RTS
     gpio_init(PROBE_UART_RTS);
     gpio_set_dir(PROBE_UART_RTS, GPIO_OUT);
@@ -68,35 +211,48 @@ void cdc_uart_init(void) {
 #endif
 }
 
-void cdc_task(void)
+bool cdc_task(void)
 {
     static int was_connected = 0;
-    static uint cdc_tx_oe = 0;
-    uint rx_len = 0;
+    bool busy = false;
+    uint32_t rx_head, rx_len, pos, len;
+    uint32_t tx_len;
+
+    cdc_uart_poll_errors();
+    if (!dma_channel_is_busy(rx_dma))
+        cdc_uart_rx_arm();
 
-    // Consume uart fifo regardless even if not connected
-    while(uart_is_readable(PROBE_UART_INTERFACE) && (rx_len < sizeof(rx_buf))) {
-        rx_buf[rx_len++] = uart_getc(PROBE_UART_INTERFACE);
+    rx_head = cdc_uart_rx_head();
+    rx_len = rx_head - rx_tail;
+    if (rx_len > RX_RING_SIZE) {
+        /* DMA has lapped us. Skip to the oldest data that can't be being
+         * overwritten right now */
+        cdc_uart_stats.rx_dropped += rx_len - RX_RING_SIZE / 2;
+        rx_tail = rx_head - RX_RING_SIZE / 2;
+        rx_len = RX_RING_SIZE / 2;
     }
 
     if (tud_cdc_connected()) {
         was_connected = 1;
-        int written = 0;
-        /* Implicit overflow if we don't write all the bytes to the host.
-         * Also throw away bytes if we can't write... */
+        /* Data that doesn't fit in the CDC FIFO stays in the ring for the
+         * next pass rather than being thrown away */
         if (rx_len) {
 #ifdef PROBE_UART_RX_LED
           gpio_put(PROBE_UART_RX_LED, 1);
           rx_led_debounce = debounce_ticks;
 #endif
-          written = MIN(tud_cdc_write_available(), rx_len);
-          if (rx_len > written)
-              cdc_tx_oe++;
-
-          if (written > 0) {
-            tud_cdc_write(rx_buf, written);
-            tud_cdc_write_flush();
+          while (rx_len) {
+            pos = rx_tail & (RX_RING_SIZE - 1);
+            len = MIN(rx_len, RX_RING_SIZE - pos);
+            len = MIN(len, tud_cdc_write_available());
+            if (!len)
+              break;
+            tud_cdc_write(&rx_ring[pos], len);
+            rx_tail += len;
+            rx_len -= len;
+            cdc_uart_stats.rx_bytes += len;
           }
+          tud_cdc_write_flush();
         } else {
 #ifdef PROBE_UART_RX_LED
           if (rx_led_debounce)
@@ -106,18 +262,30 @@ void cdc_task(void)
 #endif
         }
 
-      /* Reading from a firehose and writing to a FIFO. */
-      size_t watermark = MIN(tud_cdc_available(), sizeof(tx_buf));
-      if (watermark > 0) {
-        size_t tx_len;
+      /* Retire the last DMA burst, top the ring up from the host and send
+       * whatever is pending. A full ring backpressures the host. */
+      if (!dma_channel_is_busy(tx_dma)) {
+        tx_tail += tx_inflight;
+        tx_inflight = 0;
+      }
+      while ((tx_len = TX_RING_SIZE - (tx_head - tx_tail)) && tud_cdc_available()) {
+        pos = tx_head & (TX_RING_SIZE - 1);
+        len = tud_cdc_read(&tx_ring[pos], MIN(tx_len, TX_RING_SIZE - pos));
+        if (!len)
+          break;
+        tx_head += len;
+        cdc_uart_stats.tx_bytes += len;
+      }
+      if (tx_head != tx_tail) {
 #ifdef PROBE_UART_TX_LED
         gpio_put(PROBE_UART_TX_LED, 1);
         tx_led_debounce = debounce_ticks;
 #endif
-        /* Batch up to half a FIFO of data - don't clog up on RX */
-        watermark = MIN(watermark, 16);
-        tx_len = tud_cdc_read(tx_buf, watermark);
-        uart_write_blocking(PROBE_UART_INTERFACE, tx_buf, tx_len);
+        if (!tx_inflight) {
+          tx_inflight = tx_head - tx_tail;
+          dma_channel_set_read_addr(tx_dma, &tx_ring[tx_tail & (TX_RING_SIZE - 1)], false);
+          dma_channel_set_trans_count(tx_dma, tx_inflight, true);
+        }
       } else {
 #ifdef PROBE_UART_TX_LED
           if (tx_led_debounce)
@@ -126,30 +294,74 @@ void cdc_task(void)
             gpio_put(PROBE_UART_TX_LED, 0);
 #endif
       }
-    } else if (was_connected) {
-      tud_cdc_write_clear();
-      was_connected = 0;
-      cdc_tx_oe = 0;
+    } else {
+      /* Consume uart data regardless even if not connected */
+      rx_tail = rx_head;
+      rx_len = 0;
+      if (was_connected) {
+        tud_cdc_write_clear();
+        was_connected = 0;
+      }
     }
+
+    /* Keep polling while data is flowing, park RX once a pass sees none */
+    if (!rx_idle) {
+      if (rx_head == rx_last_head && !rx_len) {
+        cdc_uart_rx_park();
+        /* Bytes DMA moved before it was stopped are in the ring, not the
+         * FIFO, so no interrupt will announce them. Poll once more. */
+        if (cdc_uart_rx_head() != rx_head)
+          busy = true;
+      } else {
+        busy = true;
+      }
+    }
+    rx_last_head = rx_head;
+    /* Unsent RX is retried when the host takes some data */
+    busy |= rx_len != 0;
+#ifdef PROBE_UART_RX_LED
+    busy |= rx_led_debounce != 0;
+#endif
+#ifdef PROBE_UART_TX_LED
+    busy |= tx_led_debounce != 0;
+#endif
+    return busy;
 }
 
 void cdc_thread(void *ptr)
 {
-  BaseType_t delayed;
-  last_wake = xTaskGetTickCount();
-  /* Threaded with a polling interval that scales according to linerate */
+  bool busy;
+  /* Woken by UART, DMA and CDC events. Only poll, at an interval that
+   * scales with linerate, while data is actually flowing. */
   while (1) {
-    cdc_task();
-    delayed = xTaskDelayUntil(&last_wake, interval);
-    if (delayed == pdFALSE)
-      last_wake = xTaskGetTickCount();
+    busy = cdc_task();
+    ulTaskNotifyTake(pdTRUE, busy ? interval : portMAX_DELAY);
   }
 }
 
+void tud_cdc_rx_cb(uint8_t itf)
+{
+  // The other CDC interfaces have threads of their own
+  if (itf != 0)
+    return;
+  if (uart_taskhandle)
+    xTaskNotifyGive(uart_taskhandle);
+}
+
+void tud_cdc_tx_complete_cb(uint8_t itf)
+{
+  if (itf != 0)
+    return;
+  if (uart_taskhandle)
+    xTaskNotifyGive(uart_taskhandle);
+}
+
 void tud_cdc_line_coding_cb(uint8_t itf, cdc_line_coding_t const* line_coding)
 {
   uart_parity_t parity;
   uint data_bits, stop_bits;
+  if (itf != 0)
+    return;
   /* Set the tick thread interval to the amount of time it takes to
    * fill up half a FIFO. Millis is too coarse for integer divide.
    */
@@ -161,6 +373,7 @@ void tud_cdc_line_coding_cb(uint8_t itf, cdc_line_coding_t const* line_coding)
   probe_info("New baud rate %ld micros %ld interval %lu\n",
                   line_coding->bit_rate, micros, interval);
   uart_deinit(PROBE_UART_INTERFACE);
+  cdc_uart_tx_reset();
   tud_cdc_write_clear();
   tud_cdc_read_flush();
   uart_init(PROBE_UART_INTERFACE, line_coding->bit_rate);
@@ -209,11 +422,14 @@ void tud_cdc_line_coding_cb(uint8_t itf, cdc_line_coding_t const* line_coding)
   }
 
   uart_set_format(PROBE_UART_INTERFACE, data_bits, stop_bits, parity);
+  cdc_uart_rx_setup();
   vTaskResume(uart_taskhandle);
 }
 
 void tud_cdc_line_state_cb(uint8_t itf, bool dtr, bool rts)
 {
+  if (itf != 0)
+    return;
 #ifdef PROBE_UART_RTS
   gpio_put(PROBE_UART_RTS, !rts);
 #endif
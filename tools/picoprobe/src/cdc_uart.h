@@ -26,9 +26,22 @@
 #ifndef CDC_UART_H
 #define CDC_UART_H
 
+/* Bridge counters, for the host to read back with a vendor command */
+struct cdc_uart_stats {
+    uint32_t rx_bytes;      // UART to USB
+    uint32_t tx_bytes;      // USB to UART
+    uint32_t rx_dropped;    // Lost to RX ring overrun
+    uint32_t uart_overrun;  // PL011 error events
+    uint32_t uart_break;
+    uint32_t uart_parity;
+    uint32_t uart_framing;
+};
+
+extern struct cdc_uart_stats cdc_uart_stats;
+
 void cdc_thread(void *ptr);
 void cdc_uart_init(void);
-void cdc_task(void);
+bool cdc_task(void);
 
 extern TaskHandle_t uart_taskhandle;
 
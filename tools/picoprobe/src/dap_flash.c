@@ -0,0 +1,341 @@
+/*
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2023 Raspberry Pi (Trading) Ltd.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ *
+ */
+
+#include <stdbool.h>
+#include <pico/stdlib.h>
+
+#include "DAP_config.h"
+#include "DAP.h"
+#include "dap_flash.h"
+
+#define AP_CSW  0x00U
+#define AP_TAR  0x04U
+#define AP_DRW  0x0CU
+
+/* Cortex-M debug registers */
+#define DHCSR   0xE000EDF0U
+#define DCRSR   0xE000EDF4U
+#define DCRDR   0xE000EDF8U
+
+#define DBGKEY          (0xA05FU << 16)
+#define C_DEBUGEN       (1U << 0)
+#define C_HALT          (1U << 1)
+#define C_MASKINTS      (1U << 3)
+#define S_REGRDY        (1U << 16)
+#define S_HALT          (1U << 17)
+#define DCRSR_REGWnR    (1U << 16)
+
+#define REG_R9      9U
+#define REG_SP      13U
+#define REG_LR      14U
+#define REG_PC      15U
+#define REG_XPSR    16U
+#define XPSR_T      (1U << 24)
+
+/* DHCSR polls before a core register access is given up on */
+#define REGRDY_TRIES 100U
+
+/* One per SWD port, so that targets on different ports program in parallel */
+static struct flash_state {
+    struct dap_flash_algo algo;
+    bool valid;
+    uint32_t csw;
+    bool streaming;     // Between dap_flash_start() and dap_flash_finish()
+    uint32_t addr;      // Flash address of the page being filled
+    uint32_t fill;      // Bytes in the page being filled
+    uint cur;           // Buffer being filled
+    bool busy;          // ProgramPage() running on the other buffer
+    uint32_t busy_addr;
+    uint32_t result;    // First failure since dap_flash_start()
+    uint32_t fail_addr;
+} flash_ports[PROBE_PORTS];
+
+/* The selected port's state, set on entry to each dap_flash_*() */
+static struct flash_state *flash;
+
+static void flash_port(void) {
+    flash = &flash_ports[probe_get_port()];
+}
+
+static bool flash_xfer(uint32_t request, uint32_t *data) {
+    uint32_t retry = DAP_Data.transfer.retry_count;
+    uint8_t ack;
+
+    do {
+#if (DAP_JTAG != 0)
+        if (DAP_Data.debug_port == DAP_PORT_JTAG)
+            ack = JTAG_Transfer(request, data);
+        else
+#endif
+            ack = SWD_Transfer(request, data);
+    } while ((ack == DAP_TRANSFER_WAIT) && retry-- && !DAP_TransferAbort);
+    return ack == DAP_TRANSFER_OK;
+}
+
+/* Point SELECT at AP 0 bank 0, as the host may have moved it since */
+static bool flash_select(void) {
+    uint32_t val = 0U;
+
+    if (DAP_Data.debug_port == DAP_PORT_DISABLED)
+        return false;
+    return flash_xfer(DP_SELECT, &val) &&
+           flash_xfer(DAP_TRANSFER_APnDP | AP_CSW, &flash->csw);
+}
+
+static bool mem_write(uint32_t addr, uint32_t val) {
+    return flash_xfer(DAP_TRANSFER_APnDP | AP_TAR, &addr) &&
+           flash_xfer(DAP_TRANSFER_APnDP | AP_DRW, &val);
+}
+
+static bool mem_read(uint32_t addr, uint32_t *val) {
+    /* AP reads are posted, RDBUFF returns the value */
+    return flash_xfer(DAP_TRANSFER_APnDP | AP_TAR, &addr) &&
+           flash_xfer(DAP_TRANSFER_APnDP | DAP_TRANSFER_RnW | AP_DRW, NULL) &&
+           flash_xfer(DP_RDBUFF | DAP_TRANSFER_RnW, val);
+}
+
+/* TAR only auto-increments within a 1 KiB block, so it is rewritten at each boundary */
+static bool mem_write_block(uint32_t addr, const uint8_t *data, uint32_t count) {
+    uint32_t val;
+    bool set_tar = true;
+
+    for (; count; count -= 4U, data += 4U, addr += 4U) {
+        if (set_tar || (addr & 0x3FFU) == 0U) {
+            val = addr;
+            if (!flash_xfer(DAP_TRANSFER_APnDP | AP_TAR, &val))
+                return false;
+            set_tar = false;
+        }
+        val = (uint32_t)data[0] | ((uint32_t)data[1] << 8) |
+              ((uint32_t)data[2] << 16) | ((uint32_t)data[3] << 24);
+        if (!flash_xfer(DAP_TRANSFER_APnDP | AP_DRW, &val))
+            return false;
+    }
+    return true;
+}
+
+static bool core_regrdy(void) {
+    uint32_t dhcsr;
+    uint i;
+
+    for (i = 0; i < REGRDY_TRIES; i++) {
+        if (!mem_read(DHCSR, &dhcsr))
+            return false;
+        if (dhcsr & S_REGRDY)
+            return true;
+    }
+    return false;
+}
+
+static bool core_write_reg(uint32_t reg, uint32_t val) {
+    return mem_write(DCRDR, val) &&
+           mem_write(DCRSR, reg | DCRSR_REGWnR) &&
+           core_regrdy();
+}
+
+static bool core_read_reg(uint32_t reg, uint32_t *val) {
+    return mem_write(DCRSR, reg) &&
+           core_regrdy() &&
+           mem_read(DCRDR, val);
+}
+
+/* Start pc(r0, r1, r2) on the halted core, returning to the breakpoint */
+static bool flash_run(uint32_t pc, uint32_t r0, uint32_t r1, uint32_t r2) {
+    uint32_t dhcsr;
+
+    if (!mem_read(DHCSR, &dhcsr) || !(dhcsr & S_HALT))
+        return false;
+    /* C_MASKINTS may only change while halted */
+    return mem_write(DHCSR, DBGKEY | C_MASKINTS | C_HALT | C_DEBUGEN) &&
+           core_write_reg(0U, r0) &&
+           core_write_reg(1U, r1) &&
+           core_write_reg(2U, r2) &&
+           core_write_reg(REG_R9, flash->algo.static_base) &&
+           core_write_reg(REG_SP, flash->algo.stack_top) &&
+           core_write_reg(REG_LR, flash->algo.breakpoint | 1U) &&
+           core_write_reg(REG_PC, pc) &&
+           core_write_reg(REG_XPSR, XPSR_T) &&
+           mem_write(DHCSR, DBGKEY | C_MASKINTS | C_DEBUGEN);
+}
+
+/* Poll for the core to halt at the breakpoint, then fetch the return value.
+ * A halt anywhere else, such as on a fault, is a failure. On a timeout the
+ * core is halted wherever it is. The host can't abort the wait, as its
+ * commands queue behind this one. */
+static bool flash_wait(uint32_t timeout_ms, uint32_t *r0) {
+    uint32_t start = time_us_32();
+    uint32_t dhcsr, pc;
+
+    while (1) {
+        if (!mem_read(DHCSR, &dhcsr))
+            return false;
+        if (dhcsr & S_HALT)
+            return core_read_reg(REG_PC, &pc) &&
+                   pc == (flash->algo.breakpoint & ~1U) &&
+                   core_read_reg(0U, r0);
+        if (time_us_32() - start > timeout_ms * 1000U)
+            break;
+    }
+    mem_write(DHCSR, DBGKEY | C_MASKINTS | C_HALT | C_DEBUGEN);
+    return false;
+}
+
+static void flash_fail(uint32_t result, uint32_t addr) {
+    if (flash->result == 0U) {
+        flash->result = result;
+        flash->fail_addr = addr;
+    }
+}
+
+/* Wait for the page in flight, if any */
+static bool flash_page_done(void) {
+    uint32_t r0;
+
+    if (!flash->busy)
+        return true;
+    flash->busy = false;
+    if (!flash_wait(DAP_FLASH_PAGE_TIMEOUT_MS, &r0))
+        r0 = DAP_FLASH_ERR_TARGET;
+    if (r0 != 0U) {
+        flash_fail(r0, flash->busy_addr);
+        return false;
+    }
+    return true;
+}
+
+/* Program the filled buffer, and switch to the other one */
+static bool flash_page_start(void) {
+    if (!flash_page_done())
+        return false;
+    if (!flash_run(flash->algo.program_page, flash->addr, flash->fill, flash->algo.buf[flash->cur])) {
+        flash_fail(DAP_FLASH_ERR_TARGET, flash->addr);
+        return false;
+    }
+    flash->busy = true;
+    flash->busy_addr = flash->addr;
+    flash->addr += flash->fill;
+    flash->fill = 0U;
+    flash->cur ^= 1U;
+    return true;
+}
+
+uint32_t dap_flash_setup(const struct dap_flash_algo *algo) {
+    uint32_t val;
+
+    flash_port();
+    if (flash->busy && flash_select())
+        flash_page_done();
+    flash->busy = false;
+    flash->streaming = false;
+    flash->valid = false;
+
+    if (algo->page_size == 0U || (algo->page_size & 3U) ||
+        (algo->buf[0] & 3U) || (algo->buf[1] & 3U))
+        return DAP_ERROR;
+    flash->algo = *algo;
+
+    /* Keep the AP's other CSW bits, with 32-bit accesses and single auto-increment */
+    val = 0U;
+    if (!flash_xfer(DP_SELECT, &val) ||
+        !flash_xfer(DAP_TRANSFER_APnDP | DAP_TRANSFER_RnW | AP_CSW, NULL) ||
+        !flash_xfer(DP_RDBUFF | DAP_TRANSFER_RnW, &val))
+        return DAP_ERROR;
+    flash->csw = (val & ~0x3FU) | 0x12U;
+    flash->valid = true;
+    return DAP_OK;
+}
+
+uint32_t dap_flash_call(uint32_t pc, uint32_t r0, uint32_t r1, uint32_t r2,
+                        uint32_t timeout_ms, uint32_t *result) {
+    flash_port();
+    *result = DAP_FLASH_ERR_TARGET;
+    if (!flash->valid || !flash_select())
+        return DAP_ERROR;
+    flash_page_done();
+    if (!flash_run(pc, r0, r1, r2) || !flash_wait(timeout_ms, result))
+        return DAP_ERROR;
+    return DAP_OK;
+}
+
+uint32_t dap_flash_start(uint32_t addr) {
+    flash_port();
+    if (!flash->valid || !flash_select())
+        return DAP_ERROR;
+    flash_page_done();
+    flash->streaming = true;
+    flash->addr = addr;
+    flash->fill = 0U;
+    flash->cur = 0U;
+    flash->result = 0U;
+    flash->fail_addr = 0U;
+    return DAP_OK;
+}
+
+uint32_t dap_flash_write(const uint8_t *data, uint32_t count) {
+    uint32_t n;
+
+    flash_port();
+    if (!flash->streaming || flash->result != 0U || (count & 3U))
+        return DAP_ERROR;
+    if (!flash_select()) {
+        flash_fail(DAP_FLASH_ERR_TARGET, flash->addr);
+        return DAP_ERROR;
+    }
+    while (count) {
+        n = MIN(count, flash->algo.page_size - flash->fill);
+        if (!mem_write_block(flash->algo.buf[flash->cur] + flash->fill, data, n)) {
+            flash_fail(DAP_FLASH_ERR_TARGET, flash->addr);
+            return DAP_ERROR;
+        }
+        flash->fill += n;
+        data += n;
+        count -= n;
+        if (flash->fill == flash->algo.page_size && !flash_page_start())
+            return DAP_ERROR;
+    }
+    return DAP_OK;
+}
+
+uint32_t dap_flash_finish(uint32_t *result, uint32_t *fail_addr) {
+    flash_port();
+    if (!flash->streaming) {
+        *result = DAP_FLASH_ERR_TARGET;
+        *fail_addr = 0U;
+        return DAP_ERROR;
+    }
+    flash->streaming = false;
+    if (!flash_select()) {
+        flash_fail(DAP_FLASH_ERR_TARGET, flash->addr);
+    } else {
+        /* A short last page is programmed as it is, not padded */
+        if (flash->result == 0U && flash->fill != 0U)
+            flash_page_start();
+        flash_page_done();
+    }
+    flash->busy = false;
+    *result = flash->result;
+    *fail_addr = flash->fail_addr;
+    return (flash->result == 0U) ? DAP_OK : DAP_ERROR;
+}
@@ -0,0 +1,69 @@
+/*
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2023 Raspberry Pi (Trading) Ltd.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ *
+ */
+
+#ifndef DAP_FLASH_H
+#define DAP_FLASH_H
+
+#include <stdint.h>
+
+/*
+ * Flash programming run by the probe. The host loads a CMSIS-Pack (FLM)
+ * flash algorithm into target RAM once and describes it with
+ * dap_flash_setup(). The image is then streamed in with dap_flash_write(),
+ * and the probe writes it a page at a time into one of two target RAM
+ * buffers and calls the algorithm's ProgramPage() on it. The next page is
+ * written to the other buffer while the first one programs.
+ *
+ * Everything goes through AP 0 with 32-bit accesses, so SELECT, CSW and TAR
+ * are left changed. Each SWD port has its own state, so pages can be
+ * programming on several targets at once. The target core must be halted
+ * with the algorithm loaded before any function is run.
+ */
+
+/* The algorithm as loaded in target RAM */
+struct dap_flash_algo {
+    uint32_t program_page;  // int ProgramPage(addr, size, buf)
+    uint32_t static_base;   // R9
+    uint32_t stack_top;
+    uint32_t breakpoint;    // Functions return to a BKPT here
+    uint32_t buf[2];        // Page buffers, word aligned
+    uint32_t page_size;
+};
+
+/* Result code for a failure on the probe side, rather than from the algorithm:
+ * no target, core not halted, or the function did not return in time. */
+#define DAP_FLASH_ERR_TARGET 0xFFFFFFFFU
+
+/* Default timeout for ProgramPage() */
+#define DAP_FLASH_PAGE_TIMEOUT_MS 1000U
+
+uint32_t dap_flash_setup(const struct dap_flash_algo *algo);
+uint32_t dap_flash_call(uint32_t pc, uint32_t r0, uint32_t r1, uint32_t r2,
+                        uint32_t timeout_ms, uint32_t *result);
+uint32_t dap_flash_start(uint32_t addr);
+uint32_t dap_flash_write(const uint8_t *data, uint32_t count);
+uint32_t dap_flash_finish(uint32_t *result, uint32_t *fail_addr);
+
+#endif
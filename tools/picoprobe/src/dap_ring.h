@@ -0,0 +1,60 @@
+/**
+ * Copyright (c) 2023 Raspberry Pi (Trading) Ltd.
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+
+#ifndef DAP_RING_H
+#define DAP_RING_H
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+/* DAP_PACKET_COUNT and DAP_PACKET_SIZE come from DAP_config.h, or the host test */
+#if (DAP_PACKET_COUNT & (DAP_PACKET_COUNT - 1)) != 0
+#error "DAP_PACKET_COUNT must be a power of 2"
+#endif
+
+/*
+ * Ring of DAP packet slots. wptr and rptr are free-running counters, so
+ * (wptr - rptr) is the number of occupied slots. Commands are executed
+ * directly out of the request ring into the response ring.
+ * Each ring has one producer and one consumer, and each index is only written
+ * by its owner, with buffer_push() and buffer_pop(). A slot is handed over by
+ * the release store of the index, so no locks are needed.
+ */
+typedef struct {
+	uint8_t data[DAP_PACKET_COUNT][DAP_PACKET_SIZE];
+	uint16_t data_len[DAP_PACKET_COUNT];
+	atomic_uint_least32_t wptr;
+	atomic_uint_least32_t rptr;
+} buffer_t;
+
+static inline bool buffer_full(buffer_t *buffer)
+{
+	return ((atomic_load_explicit(&buffer->wptr, memory_order_acquire) -
+		 atomic_load_explicit(&buffer->rptr, memory_order_acquire)) == DAP_PACKET_COUNT);
+}
+
+static inline bool buffer_empty(buffer_t *buffer)
+{
+	return (atomic_load_explicit(&buffer->wptr, memory_order_acquire) ==
+		atomic_load_explicit(&buffer->rptr, memory_order_acquire));
+}
+
+// Producer only: hand the slot at wptr to the consumer
+static inline void buffer_push(buffer_t *buffer)
+{
+	atomic_store_explicit(&buffer->wptr, atomic_load_explicit(&buffer->wptr, memory_order_relaxed) + 1,
+			      memory_order_release);
+}
+
+// Consumer only: hand the slot at rptr back to the producer
+static inline void buffer_pop(buffer_t *buffer)
+{
+	atomic_store_explicit(&buffer->rptr, atomic_load_explicit(&buffer->rptr, memory_order_relaxed) + 1,
+			      memory_order_release);
+}
+
+#endif
@@ -0,0 +1,89 @@
+/*
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2023 Raspberry Pi (Trading) Ltd.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ *
+ */
+
+#ifndef DAP_STATS_H
+#define DAP_STATS_H
+
+#include <stdint.h>
+
+#include "DAP.h"
+
+/*
+ * DAP pipeline counters, for the host to read back with vendor commands.
+ * Each counter has a single writer and they all free-run, so a monitor
+ * should look at the difference between two reads.
+ */
+
+/* Per command ID, timed around DAP_ExecuteCommand() in dap_thread */
+struct dap_cmd_stats {
+    uint32_t count;
+    uint32_t total_us;
+    uint32_t max_us;
+};
+
+/* Outcome of each SWD or JTAG transfer, WAITs counting once per retry */
+struct dap_xfer_stats {
+    uint32_t transfers;
+    uint32_t wait;
+    uint32_t fault;
+    uint32_t parity;
+    uint32_t protocol;      // No or invalid ACK
+    uint32_t dropped;       // Writes not sent, the register already held the value
+};
+
+/* USB request/response ring stalls */
+struct dap_ring_stats {
+    uint32_t req_full;      // A request filled the ring, so the host had to wait
+    uint32_t req_empty;     // The DAP side ran out of requests and slept
+    uint32_t resp_full;     // A response had to wait for the host to read
+};
+
+extern struct dap_cmd_stats dap_cmd_stats[256];
+extern struct dap_xfer_stats dap_xfer_stats;
+extern struct dap_ring_stats dap_ring_stats;
+
+static inline void dap_count_ack(uint32_t ack) {
+    dap_xfer_stats.transfers++;
+    switch (ack) {
+    case DAP_TRANSFER_OK:
+        break;
+    case DAP_TRANSFER_WAIT:
+        dap_xfer_stats.wait++;
+        break;
+    case DAP_TRANSFER_FAULT:
+        dap_xfer_stats.fault++;
+        break;
+    case DAP_TRANSFER_ERROR:
+        dap_xfer_stats.parity++;
+        break;
+    default:
+        dap_xfer_stats.protocol++;
+        break;
+    }
+}
+
+void dap_stats_clear(void);
+
+#endif
@@ -0,0 +1,234 @@
+/*
+ * Copyright (c) 2013-2017 ARM Limited. All rights reserved.
+ * Copyright (c) 2023 Raspberry Pi Ltd
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ * Licensed under the Apache License, Version 2.0 (the License); you may
+ * not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an AS IS BASIS, WITHOUT
+ * WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * This is a shim between the JTAG_DP functions and the PIO JTAG engine, as
+ * sw_dp_pio.c is for SWD. Each scan is built as a list of probe_jtag
+ * commands, one per run of TCKs with the same TMS, and sent to the SM in one
+ * DMA burst. The TAP state walk is the same as in JTAG_DP.c.
+ */
+
+#include "DAP_config.h"
+#include "DAP.h"
+#include "probe.h"
+#include "dap_stats.h"
+
+#if (DAP_JTAG != 0)
+
+static uint32_t jtag_rx[PROBE_QUEUE_JTAG_MAX];
+static uint jtag_cmds;
+
+/* Run the queued list. TDO for command n is in jtag_rx[n], right-aligned. */
+static void jtag_run (void) {
+  if (jtag_cmds) {
+    probe_queue_run(jtag_rx);
+    jtag_cmds = 0;
+  }
+}
+
+/* Queue 1..32 TCKs with TMS held, returns the jtag_rx slot for their TDO.
+ * A full list is run first, so only the last list's TDO survives - none of
+ * the scans that need TDO come close to the limit. */
+static uint jtag_queue (uint32_t count, uint32_t tms, uint32_t tdi) {
+  if (jtag_cmds == PROBE_QUEUE_JTAG_MAX) {
+    jtag_run();
+  }
+  probe_queue_jtag(count, tms != 0U, tdi);
+  return jtag_cmds++;
+}
+
+/* Any number of TCKs with TDI high, for bypass and idle */
+static void jtag_queue_ones (uint32_t count, uint32_t tms) {
+  uint32_t n;
+
+  while (count) {
+    n = (count > 32U) ? 32U : count;
+    jtag_queue(n, tms, 0xFFFFFFFFU);
+    count -= n;
+  }
+}
+
+// Generate SWJ Sequence in JTAG mode: SWJ data goes out on TMS
+//   count:  sequence bit count
+//   data:   pointer to sequence bit data
+//   return: none
+void JTAG_SWJ_Sequence (uint32_t count, const uint8_t *data) {
+  uint32_t i, n, tms;
+
+  swj_update_clock();
+  for (i = 0U; i < count; i += n) {
+    tms = (data[i >> 3] >> (i & 7U)) & 1U;
+    for (n = 1U; (n < 32U) && ((i + n) < count); n++) {
+      if (((data[(i + n) >> 3] >> ((i + n) & 7U)) & 1U) != tms) {
+        break;
+      }
+    }
+    jtag_queue(n, tms, 0xFFFFFFFFU);
+  }
+  jtag_run();
+}
+
+// Generate JTAG Sequence
+//   info:   sequence information
+//   tdi:    pointer to TDI generated data
+//   tdo:    pointer to TDO captured data
+//   return: none
+void JTAG_Sequence (uint32_t info, const uint8_t *tdi, uint8_t *tdo) {
+  uint32_t val[2] = { 0U, 0U };
+  uint32_t tms;
+  uint32_t n, i;
+  uint     slot;
+
+  swj_update_clock();
+  n = info & JTAG_SEQUENCE_TCK;
+  if (n == 0U) {
+    n = 64U;
+  }
+  tms = info & JTAG_SEQUENCE_TMS;
+
+  for (i = 0U; i < ((n + 7U) / 8U); i++) {
+    val[i / 4U] |= (uint32_t)tdi[i] << (8U * (i & 3U));
+  }
+  slot = jtag_queue((n > 32U) ? 32U : n, tms, val[0]);
+  if (n > 32U) {
+    jtag_queue(n - 32U, tms, val[1]);
+  }
+  jtag_run();
+
+  if (info & JTAG_SEQUENCE_TDO) {
+    for (i = 0U; i < ((n + 7U) / 8U); i++) {
+      *tdo++ = (uint8_t)(jtag_rx[slot + (i / 4U)] >> (8U * (i & 3U)));
+    }
+  }
+}
+
+// JTAG Set IR
+//   ir:     IR value
+//   return: none
+void JTAG_IR (uint32_t ir) {
+  uint32_t len   = DAP_Data.jtag_dev.ir_length[DAP_Data.jtag_dev.index];
+  uint32_t after = DAP_Data.jtag_dev.ir_after[DAP_Data.jtag_dev.index];
+
+  swj_update_clock();
+  jtag_queue(2U, 1U, 0xFFFFFFFFU);          /* Select-DR-Scan, Select-IR-Scan */
+  jtag_queue(2U, 0U, 0xFFFFFFFFU);          /* Capture-IR, Shift-IR */
+  jtag_queue_ones(DAP_Data.jtag_dev.ir_before[DAP_Data.jtag_dev.index], 0U);
+  if (after) {
+    jtag_queue(len, 0U, ir);                /* Set IR bits */
+    jtag_queue_ones(after - 1U, 0U);        /* Bypass after data */
+    jtag_queue(2U, 1U, 0xFFFFFFFFU);        /* Bypass & Exit1-IR, Update-IR */
+  } else {
+    if (len > 1U) {
+      jtag_queue(len - 1U, 0U, ir);         /* Set IR bits (except last) */
+    }
+    jtag_queue(2U, 1U, ((ir >> (len - 1U)) & 1U) | 2U); /* Last IR bit & Exit1-IR, Update-IR */
+  }
+  jtag_queue(1U, 0U, 0xFFFFFFFFU);          /* Idle */
+  jtag_run();
+}
+
+// Scan a DPACC/APACC style DR: 3 request bits out and ACK in, then 32 data
+// bits. The scan always runs to the end, even on WAIT - the DP ignores the
+// data phase then, so there is no need to see the ACK before sending it.
+//   request: A[3:2] RnW APnDP
+//   data:    DATA[31:0]
+//   idle:    idle cycles after Update-DR
+//   return:  ACK[2:0]
+static uint8_t jtag_dr_scan (uint32_t request, uint32_t *data, uint32_t idle) {
+  uint32_t index = DAP_Data.jtag_dev.index;
+  uint32_t after = DAP_Data.jtag_dev.count - index - 1U;
+  uint32_t val, bits, ack;
+  uint     ack_slot, data_slot, last_slot;
+
+  val = (request & DAP_TRANSFER_RnW) ? 0U : *data;
+
+  jtag_queue(1U, 1U, 0xFFFFFFFFU);          /* Select-DR-Scan */
+  /* Capture-DR, Shift-DR, bypass before data, then RnW A2 A3 out and ACK in */
+  bits = 2U + index;
+  ack_slot = jtag_queue(bits + 3U, 0U, (((request >> 1) & 7U) << bits) | ((1U << bits) - 1U));
+  if (after) {
+    data_slot = jtag_queue(32U, 0U, val);   /* D0..D31 */
+    last_slot = data_slot;
+    jtag_queue_ones(after - 1U, 0U);        /* Bypass after data */
+    jtag_queue(2U, 1U, 0xFFFFFFFFU);        /* Bypass & Exit1-DR, Update-DR */
+  } else {
+    data_slot = jtag_queue(31U, 0U, val);   /* D0..D30 */
+    last_slot = jtag_queue(2U, 1U, (val >> 31) | 2U); /* D31 & Exit1-DR, Update-DR */
+  }
+  jtag_queue_ones(1U + idle, 0U);           /* Idle */
+  jtag_run();
+
+  bits = jtag_rx[ack_slot] >> (2U + index);
+  ack  = ((bits & 1U) << 1) | ((bits >> 1) & 1U) | (bits & 4U);
+
+  if ((ack == DAP_TRANSFER_OK) && (request & DAP_TRANSFER_RnW) && data) {
+    if (after) {
+      *data = jtag_rx[data_slot];
+    } else {
+      *data = jtag_rx[data_slot] | ((jtag_rx[last_slot] & 1U) << 31);
+    }
+  }
+
+  return ((uint8_t)ack);
+}
+
+// JTAG Read IDCODE register
+//   return: value read
+uint32_t JTAG_ReadIDCode (void) {
+  uint slot, last_slot;
+
+  swj_update_clock();
+  jtag_queue(1U, 1U, 0xFFFFFFFFU);          /* Select-DR-Scan */
+  jtag_queue_ones(2U + DAP_Data.jtag_dev.index, 0U); /* Capture-DR, Shift-DR, bypass before data */
+  slot = jtag_queue(31U, 0U, 0xFFFFFFFFU);  /* Get D0..D30 */
+  last_slot = jtag_queue(2U, 1U, 0xFFFFFFFFU); /* Get D31 & Exit1-DR, Update-DR */
+  jtag_queue(1U, 0U, 0xFFFFFFFFU);          /* Idle */
+  jtag_run();
+
+  return (jtag_rx[slot] | ((jtag_rx[last_slot] & 1U) << 31));
+}
+
+// JTAG Write ABORT register
+//   data:   value to write
+//   return: none
+void JTAG_WriteAbort (uint32_t data) {
+  swj_update_clock();
+  jtag_dr_scan(0U, &data, 0U);
+}
+
+// JTAG Transfer I/O
+//   request: A[3:2] RnW APnDP
+//   data:    DATA[31:0]
+//   return:  ACK[2:0]
+uint8_t JTAG_Transfer (uint32_t request, uint32_t *data) {
+  uint8_t ack;
+
+  swj_update_clock();
+  ack = jtag_dr_scan(request, data, DAP_Data.transfer.idle_cycles);
+  dap_count_ack(ack);
+
+  /* Capture Timestamp */
+  if (request & DAP_TRANSFER_TIMESTAMP) {
+    DAP_Data.timestamp = TIMESTAMP_GET();
+  }
+
+  return (ack);
+}
+
+#endif  /* (DAP_JTAG != 0) */
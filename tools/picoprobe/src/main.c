@@ -28,6 +28,9 @@
 #include "task.h"
 
 #include <pico/stdlib.h>
+#if (PROBE_DAP_CORE1 != 0)
+#include <pico/multicore.h>
+#endif
 #include <stdio.h>
 #include <string.h>
 
@@ -40,26 +43,87 @@
 #include "get_serial.h"
 #include "led.h"
 #include "tusb_edpt_handler.h"
+#include "DAP_config.h"
 #include "DAP.h"
+#include "task_stats.h"
+#ifdef PROBE_RTT
+#include "probe_rtt.h"
+#endif
 
 // UART0 for debugprobe debug
 // UART1 for debugprobe to target device
 
+#if (PROBE_DEBUG_PROTOCOL == PROTO_DAP_V2)
 static uint8_t TxDataBuffer[CFG_TUD_HID_EP_BUFSIZE];
 static uint8_t RxDataBuffer[CFG_TUD_HID_EP_BUFSIZE];
+#endif
 
 #define THREADED 1
 
 #define UART_TASK_PRIO (tskIDLE_PRIORITY + 3)
 #define TUD_TASK_PRIO  (tskIDLE_PRIORITY + 2)
+/*
+ * The DAP task starts endpoint transfers as well as the USB task's callbacks.
+ * It must stay below TUD, so that it never runs between TinyUSB freeing an
+ * endpoint and the callback for it.
+ */
 #define DAP_TASK_PRIO  (tskIDLE_PRIORITY + 1)
+#define SWO_TASK_PRIO  (tskIDLE_PRIORITY + 1)
+#define TRACE_TASK_PRIO (tskIDLE_PRIORITY + 1)
+#define RTT_TASK_PRIO  (tskIDLE_PRIORITY + 1)
+
+/* Stack depths in words. Vendor command 0x88 reports how much of each is used. */
+#define UART_TASK_STACK  configMINIMAL_STACK_SIZE
+#define TUD_TASK_STACK   configMINIMAL_STACK_SIZE
+#define DAP_TASK_STACK   configMINIMAL_STACK_SIZE
+#define SWO_TASK_STACK   configMINIMAL_STACK_SIZE
+#define TRACE_TASK_STACK configMINIMAL_STACK_SIZE
+#define RTT_TASK_STACK   configMINIMAL_STACK_SIZE
 
 TaskHandle_t dap_taskhandle, tud_taskhandle;
+#if (SWO_STREAM != 0)
+TaskHandle_t SWO_ThreadId;
+#endif
+
+#if (configSUPPORT_STATIC_ALLOCATION != 0)
+/* Each call site gets its own stack and TCB */
+#define task_create(fn, name, depth, prio, handle) do {                     \
+        static StackType_t fn##_stack[depth];                               \
+        static StaticTask_t fn##_tcb;                                       \
+        *(handle) = xTaskCreateStatic(fn, name, depth, NULL, prio,          \
+                                      fn##_stack, &fn##_tcb);               \
+        if (*(handle) != NULL)                                              \
+            task_stats_add(*(handle), depth);                               \
+    } while (0)
+
+void vApplicationGetTimerTaskMemory(StaticTask_t **tcb, StackType_t **stack, uint32_t *depth)
+{
+    static StaticTask_t timer_tcb;
+    static StackType_t timer_stack[configTIMER_TASK_STACK_DEPTH];
+
+    *tcb = &timer_tcb;
+    *stack = timer_stack;
+    *depth = configTIMER_TASK_STACK_DEPTH;
+}
+#else
+/* Only tasks that exist are registered, as the handle is unset on failure */
+#define task_create(fn, name, depth, prio, handle) do {                     \
+        if (xTaskCreate(fn, name, depth, NULL, prio, handle) == pdPASS)     \
+            task_stats_add(*(handle), depth);                               \
+        else                                                                \
+            probe_info("Can't create task %s\n", name);                     \
+    } while (0)
+#endif
+
+/* tud_event_hook_cb only arrived in TinyUSB 0.15. Before it, the USB task polls. */
+#if (TUSB_VERSION_MAJOR == 0) && (TUSB_VERSION_MINOR < 15)
+#define PROBE_USB_EVENT_HOOK 0
+#else
+#define PROBE_USB_EVENT_HOOK 1
+#endif
 
 void usb_thread(void *ptr)
 {
-    TickType_t wake;
-    wake = xTaskGetTickCount();
     do {
         tud_task();
 #ifdef PROBE_USB_CONNECTED_LED
@@ -68,22 +132,58 @@ void usb_thread(void *ptr)
         else
             gpio_put(PROBE_USB_CONNECTED_LED, 0);
 #endif
-        // Go to sleep for up to a tick if nothing to do
+#if PROBE_USB_EVENT_HOOK
+        // Sleep until tud_event_hook_cb says there is something to do
         if (!tud_task_event_ready())
-            xTaskDelayUntil(&wake, 1);
+            ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+#else
+        // No event hook, so look again at the next tick
+        ulTaskNotifyTake(pdTRUE, 1);
+#endif
     } while (1);
 }
 
+/*
+ * With the Pico OS abstraction, tud_task() doesn't block, so the USB task is
+ * woken for each event TinyUSB queues. A wake-up given while it is still
+ * busy is kept, so none is lost. Events may be queued before the scheduler
+ * has started, from the USB interrupt.
+ */
+#if PROBE_USB_EVENT_HOOK
+void tud_event_hook_cb(uint8_t rhport, uint32_t eventid, bool in_isr)
+{
+    BaseType_t woken = pdFALSE;
+
+    (void) rhport;
+    (void) eventid;
+
+    if (!tud_taskhandle)
+        return;
+    if (in_isr) {
+        vTaskNotifyGiveFromISR(tud_taskhandle, &woken);
+        portYIELD_FROM_ISR(woken);
+    } else {
+        xTaskNotifyGive(tud_taskhandle);
+    }
+}
+#endif
+
 // Workaround API change in 0.13
 #if (TUSB_VERSION_MAJOR == 0) && (TUSB_VERSION_MINOR <= 12)
 #define tud_vendor_flush(x) ((void)0)
 #endif
 
 int main(void) {
+#if defined(PROBE_TRACE) || defined(PROBE_RTT)
+    TaskHandle_t task = NULL;
+#endif
 
     board_init();
     usb_serial_init();
     cdc_uart_init();
+#if (SWO_UART != 0)
+    swo_pio_init();
+#endif
     tusb_init();
 
     DAP_Setup();
@@ -94,11 +194,26 @@ int main(void) {
     probe_info("Welcome to debugprobe!\n");
 
     if (THREADED) {
+#if (PROBE_DAP_CORE1 != 0)
+        /* Before the scheduler starts, so the launch handshake has the SIO FIFO to itself */
+        multicore_launch_core1(dap_core1_thread);
+#endif
         /* UART needs to preempt USB as if we don't, characters get lost */
-        xTaskCreate(cdc_thread, "UART", configMINIMAL_STACK_SIZE, NULL, UART_TASK_PRIO, &uart_taskhandle);
-        xTaskCreate(usb_thread, "TUD", configMINIMAL_STACK_SIZE, NULL, TUD_TASK_PRIO, &tud_taskhandle);
+        task_create(cdc_thread, "UART", UART_TASK_STACK, UART_TASK_PRIO, &uart_taskhandle);
+        task_create(usb_thread, "TUD", TUD_TASK_STACK, TUD_TASK_PRIO, &tud_taskhandle);
         /* Lowest priority thread is debug - need to shuffle buffers before we can toggle swd... */
-        xTaskCreate(dap_thread, "DAP", configMINIMAL_STACK_SIZE, NULL, DAP_TASK_PRIO, &dap_taskhandle);
+        task_create(dap_thread, "DAP", DAP_TASK_STACK, DAP_TASK_PRIO, &dap_taskhandle);
+#if (SWO_STREAM != 0)
+        /* Shuffles SWO trace from the capture buffer to its USB endpoint */
+        task_create(SWO_Thread, "SWO", SWO_TASK_STACK, SWO_TASK_PRIO, &SWO_ThreadId);
+#endif
+#ifdef PROBE_TRACE
+        task_create(probe_trace_thread, "Trace", TRACE_TASK_STACK, TRACE_TASK_PRIO, &task);
+#endif
+#ifdef PROBE_RTT
+        /* Moves RTT data between the DAP thread's rings and its CDC interface */
+        task_create(probe_rtt_thread, "RTT", RTT_TASK_STACK, RTT_TASK_PRIO, &task);
+#endif
         vTaskStartScheduler();
     }
 
@@ -119,32 +234,6 @@ int main(void) {
     return 0;
 }
 
-uint16_t tud_hid_get_report_cb(uint8_t itf, uint8_t report_id, hid_report_type_t report_type, uint8_t* buffer, uint16_t reqlen)
-{
-  // TODO not Implemented
-  (void) itf;
-  (void) report_id;
-  (void) report_type;
-  (void) buffer;
-  (void) reqlen;
-
-  return 0;
-}
-
-void tud_hid_set_report_cb(uint8_t itf, uint8_t report_id, hid_report_type_t report_type, uint8_t const* RxDataBuffer, uint16_t bufsize)
-{
-  uint32_t response_size = TU_MIN(CFG_TUD_HID_EP_BUFSIZE, bufsize);
-
-  // This doesn't use multiple report and report ID
-  (void) itf;
-  (void) report_id;
-  (void) report_type;
-
-  DAP_ProcessCommand(RxDataBuffer, TxDataBuffer);
-
-  tud_hid_report(0, TxDataBuffer, response_size);
-}
-
 #if (PROBE_DEBUG_PROTOCOL == PROTO_DAP_V2)
 extern uint8_t const desc_ms_os_20[];
 
@@ -182,10 +271,6 @@ bool tud_vendor_control_xfer_cb(uint8_t rhport, uint8_t stage, tusb_control_requ
 }
 #endif
 
-void vApplicationTickHook (void)
-{
-};
-
 void vApplicationStackOverflowHook(TaskHandle_t Task, char *pcTaskName)
 {
   panic("stack overflow (not the helpful kind) for %s\n", *pcTaskName);
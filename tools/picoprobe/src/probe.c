@@ -28,11 +28,12 @@
 #include <string.h>
 
 #include <hardware/clocks.h>
+#include <hardware/dma.h>
 #include <hardware/gpio.h>
 
 #include "led.h"
 #include "probe_config.h"
-#include "probe.pio.h"
+#include "probe.h"
 #include "tusb.h"
 
 #define DIV_ROUND_UP(m, n)	(((m) + (n) - 1) / (n))
@@ -51,21 +52,89 @@ CU_REGISTER_DEBUG_PINS(probe_timing)
 //CU_SELECT_DEBUG_PINS(probe_timing)
 
 #define PROBE_BUF_SIZE 8192
+
+// Command lists for the transaction engine. Two TX buffers so that a new list
+// can be built while the previous one is still streaming out to the SM.
+#define PROBE_QUEUE_LEN 64
+struct _probe_queue {
+    uint32_t tx[2][PROBE_QUEUE_LEN];
+    uint8_t rx_bits[2][PROBE_QUEUE_LEN];
+    uint tx_len;
+    uint rx_len;
+    uint buf;
+    // List started by probe_queue_start() and not yet collected
+    uint32_t *run_rx;
+    uint run_len;
+    uint run_buf;
+};
+
 struct _probe {
+    // State machine and pins of this port
+    PIO pio;
+    uint sm;
+    uint pin_offset;
     // PIO offset
     uint offset;
     uint initted;
+    // DMA channels feeding the TX FIFO and draining the RX FIFO
+    uint tx_dma;
+    uint rx_dma;
+    // SWCLK actually generated, after divider rounding
+    uint swclk_khz;
+    // probe_jtag rather than probe is loaded
+    bool jtag;
+    struct _probe_queue queue;
 };
 
-static struct _probe probe;
+/*
+ * Each SWD port has its own SM, DMA channels and command lists, all on PIO0
+ * and sharing one copy of the SWD program. Everything below works on the
+ * selected port, and a list left running on one port carries on while
+ * another is in use.
+ */
+static struct _probe probes[PROBE_PORTS] = {
+    { .pio = pio0, .sm = PROBE_SM, .pin_offset = PROBE_PIN_OFFSET },
+#if PROBE_PORTS > 1
+    { .pio = pio0, .sm = PROBE_SM + 1, .pin_offset = PROBE_PORT1_PIN_OFFSET },
+#endif
+};
+
+static struct _probe *probe = &probes[0];
+static struct _probe_queue *queue = &probes[0].queue;
+
+// Ports running the SWD program, which is only removed when the last one stops
+static uint swd_program_users;
+static uint swd_program_offset;
 
-void probe_set_swclk_freq(uint freq_khz) {
+void probe_set_port(uint port) {
+    if (port < PROBE_PORTS) {
+        probe = &probes[port];
+        queue = &probe->queue;
+    }
+}
+
+uint probe_get_port(void) {
+    return probe - probes;
+}
+
+uint probe_set_swclk_freq(uint freq_khz) {
         uint clk_sys_freq_khz = clock_get_hz(clk_sys) / 1000;
-        probe_info("Set swclk freq %dKHz sysclk %dkHz\n", freq_khz, clk_sys_freq_khz);
-        uint32_t divider = clk_sys_freq_khz / freq_khz / 4;
-        if (divider == 0)
-            divider = 1;
-        pio_sm_set_clkdiv_int_frac(pio0, PROBE_SM, divider, 0);
+        if (freq_khz == 0)
+            freq_khz = 1;
+        // 16.8 fixed point divider, rounded to nearest. One SWCLK is 4 SM cycles.
+        uint32_t divider = (clk_sys_freq_khz * 64 + freq_khz / 2) / freq_khz;
+        if (divider < 0x100)
+            divider = 0x100;
+        if (divider > 0xffffff)
+            divider = 0xffffff;
+        pio_sm_set_clkdiv_int_frac(probe->pio, probe->sm, divider >> 8, divider & 0xff);
+        probe->swclk_khz = (clk_sys_freq_khz * 64 + divider / 2) / divider;
+        probe_info("Set swclk freq %dKHz (actual %dKHz) sysclk %dkHz\n", freq_khz, probe->swclk_khz, clk_sys_freq_khz);
+        return probe->swclk_khz;
+}
+
+uint probe_get_swclk_freq(void) {
+        return probe->swclk_khz;
 }
 
 void probe_assert_reset(bool state)
@@ -89,36 +158,166 @@ typedef enum probe_pio_command {
     CMD_WRITE = 0,
     CMD_SKIP,
     CMD_TURNAROUND,
-    CMD_READ
+    CMD_READ,
+#if defined(PROBE_SWD_XFER)
+    CMD_XFER,
+#endif
 } probe_pio_command_t;
 
 static inline uint32_t fmt_probe_command(uint bit_count, bool out_en, probe_pio_command_t cmd) {
     uint cmd_addr =
-        cmd == CMD_WRITE      ? probe.offset + probe_offset_write_cmd :
-        cmd == CMD_SKIP       ? probe.offset + probe_offset_get_next_cmd :
-        cmd == CMD_TURNAROUND ? probe.offset + probe_offset_turnaround_cmd :
-                                probe.offset + probe_offset_read_cmd;
+        cmd == CMD_WRITE      ? probe->offset + probe_offset_write_cmd :
+        cmd == CMD_SKIP       ? probe->offset + probe_offset_get_next_cmd :
+        cmd == CMD_TURNAROUND ? probe->offset + probe_offset_turnaround_cmd :
+#if defined(PROBE_SWD_XFER)
+        cmd == CMD_XFER       ? probe->offset + probe_offset_xfer_cmd :
+#endif
+                                probe->offset + probe_offset_read_cmd;
     return ((bit_count - 1) & 0xff) | ((uint)out_en << 8) | (cmd_addr << 9);
 }
 
+static inline void probe_queue_wait_tx(void) {
+    // Direct FIFO access must not overtake a command list still going out by DMA
+    dma_channel_wait_for_finish_blocking(probe->tx_dma);
+}
+
+static inline void probe_queue_push(uint32_t word) {
+    queue->tx[queue->buf][queue->tx_len++] = word;
+}
+
+void probe_queue_write(uint bit_count, uint32_t data) {
+    probe_queue_push(fmt_probe_command(bit_count, true, CMD_WRITE));
+    probe_queue_push(data);
+}
+
+void probe_queue_hiz(uint bit_count) {
+    probe_queue_push(fmt_probe_command(bit_count, false, CMD_TURNAROUND));
+}
+
+void probe_queue_read(uint bit_count) {
+    probe_queue_push(fmt_probe_command(bit_count, false, CMD_READ));
+    queue->rx_bits[queue->buf][queue->rx_len++] = bit_count;
+}
+
+#if defined(PROBE_SWD_XFER)
+void probe_queue_xfer(uint8_t header, uint turnaround) {
+    uint32_t cmd = fmt_probe_command(8, true, CMD_XFER);
+
+    cmd |= (uint32_t)header << 14;
+    cmd |= (uint32_t)((turnaround - 1) & 0x3) << 22;
+    probe_queue_push(cmd);
+    // 0 marks a status word, which the SM has already right-aligned
+    queue->rx_bits[queue->buf][queue->rx_len++] = 0;
+}
+
+// Called once the SM has parked at xfer_fault: throw away whatever is left of
+// the list and return the SM to the command dispatcher.
+static uint probe_queue_abort(uint rx_len) {
+    // The status word is pushed before the SM parks, let DMA collect it
+    while (!pio_sm_is_rx_fifo_empty(probe->pio, probe->sm))
+        tight_loop_contents();
+    dma_channel_abort(probe->rx_dma);
+    dma_channel_abort(probe->tx_dma);
+    rx_len -= dma_channel_hw_addr(probe->rx_dma)->transfer_count;
+    pio_sm_clear_fifos(probe->pio, probe->sm);
+    pio_sm_exec(probe->pio, probe->sm, pio_encode_jmp(probe->offset + probe_offset_get_next_cmd));
+    probe_dump("Queue abort after %d reads\n", rx_len);
+    return rx_len;
+}
+#endif
+
+#if defined(PROBE_PIN_TDI)
+void probe_queue_jtag(uint bit_count, bool tms, uint32_t tdi) {
+    probe_queue_push(((bit_count - 1) & 0x1f) | ((uint)tms << 8));
+    probe_queue_push(tdi);
+    queue->rx_bits[queue->buf][queue->rx_len++] = bit_count;
+}
+#endif
+
+void probe_queue_start(uint32_t *rx) {
+    uint rx_len = queue->rx_len;
+
+    DEBUG_PINS_SET(probe_timing, DBG_PIN_PKT);
+    probe_queue_wait_tx();
+    // Arm RX first so nothing the SM pushes can be missed
+    if (rx_len)
+        dma_channel_transfer_to_buffer_now(probe->rx_dma, rx, rx_len);
+    dma_channel_transfer_from_buffer_now(probe->tx_dma, queue->tx[queue->buf], queue->tx_len);
+    probe_dump("Queue run %d words %d reads\n", queue->tx_len, rx_len);
+
+    queue->run_rx = rx;
+    queue->run_len = rx_len;
+    queue->run_buf = queue->buf;
+
+    queue->buf ^= 1;
+    queue->tx_len = 0;
+    queue->rx_len = 0;
+}
+
+uint probe_queue_wait(void) {
+    uint i, rx_len = queue->run_len;
+    uint32_t *rx = queue->run_rx;
+
+    // A list with no reads is left to run in the background, like probe_write_bits()
+    if (rx_len) {
+#if defined(PROBE_SWD_XFER)
+        uint fault_pc = probe->jtag ? ~0u : probe->offset + probe_offset_xfer_fault;
+        while (dma_channel_is_busy(probe->rx_dma) && pio_sm_get_pc(probe->pio, probe->sm) != fault_pc)
+            tight_loop_contents();
+        /*
+         * If the failing status was the last word expected, DMA finishes as
+         * soon as it is pushed, which may be before the SM reaches xfer_fault.
+         * So go by the status words, and wait for the SM to park.
+         */
+        if (!dma_channel_is_busy(probe->rx_dma)) {
+            for (i = 0; i < rx_len; i++) {
+                if (!queue->rx_bits[queue->run_buf][i] && rx[i] != 1) {    // DAP_TRANSFER_OK
+                    while (pio_sm_get_pc(probe->pio, probe->sm) != fault_pc)
+                        tight_loop_contents();
+                    break;
+                }
+            }
+        }
+        if (pio_sm_get_pc(probe->pio, probe->sm) == fault_pc)
+            rx_len = probe_queue_abort(rx_len);
+#else
+        dma_channel_wait_for_finish_blocking(probe->rx_dma);
+#endif
+        for (i = 0; i < rx_len; i++) {
+            if (queue->rx_bits[queue->run_buf][i] && queue->rx_bits[queue->run_buf][i] < 32)
+                rx[i] >>= 32 - queue->rx_bits[queue->run_buf][i];
+        }
+        queue->run_len = 0;
+    }
+    DEBUG_PINS_CLR(probe_timing, DBG_PIN_PKT);
+    return rx_len;
+}
+
+uint probe_queue_run(uint32_t *rx) {
+    probe_queue_start(rx);
+    return probe_queue_wait();
+}
+
 void probe_write_bits(uint bit_count, uint32_t data_byte) {
     DEBUG_PINS_SET(probe_timing, DBG_PIN_WRITE);
-    pio_sm_put_blocking(pio0, PROBE_SM, fmt_probe_command(bit_count, true, CMD_WRITE));
-    pio_sm_put_blocking(pio0, PROBE_SM, data_byte);
+    probe_queue_wait_tx();
+    pio_sm_put_blocking(probe->pio, probe->sm, fmt_probe_command(bit_count, true, CMD_WRITE));
+    pio_sm_put_blocking(probe->pio, probe->sm, data_byte);
     probe_dump("Write %d bits 0x%x\n", bit_count, data_byte);
     // Return immediately so we can cue up the next command whilst this one runs
     DEBUG_PINS_CLR(probe_timing, DBG_PIN_WRITE);
 }
 
 void probe_hiz_clocks(uint bit_count) {
-    pio_sm_put_blocking(pio0, PROBE_SM, fmt_probe_command(bit_count, false, CMD_TURNAROUND));
-    pio_sm_put_blocking(pio0, PROBE_SM, 0);
+    probe_queue_wait_tx();
+    pio_sm_put_blocking(probe->pio, probe->sm, fmt_probe_command(bit_count, false, CMD_TURNAROUND));
 }
 
 uint32_t probe_read_bits(uint bit_count) {
     DEBUG_PINS_SET(probe_timing, DBG_PIN_READ);
-    pio_sm_put_blocking(pio0, PROBE_SM, fmt_probe_command(bit_count, false, CMD_READ));
-    uint32_t data = pio_sm_get_blocking(pio0, PROBE_SM);
+    probe_queue_wait_tx();
+    pio_sm_put_blocking(probe->pio, probe->sm, fmt_probe_command(bit_count, false, CMD_READ));
+    uint32_t data = pio_sm_get_blocking(probe->pio, probe->sm);
     uint32_t data_shifted = data;
     if (bit_count < 32) {
         data_shifted = data >> (32 - bit_count);
@@ -130,46 +329,118 @@ uint32_t probe_read_bits(uint bit_count) {
 }
 
 static void probe_wait_idle() {
-    pio0->fdebug = 1u << (PIO_FDEBUG_TXSTALL_LSB + PROBE_SM);
-    while (!(pio0->fdebug & (1u << (PIO_FDEBUG_TXSTALL_LSB + PROBE_SM))))
+    probe->pio->fdebug = 1u << (PIO_FDEBUG_TXSTALL_LSB + probe->sm);
+    while (!(probe->pio->fdebug & (1u << (PIO_FDEBUG_TXSTALL_LSB + probe->sm))))
         ;
 }
 
 void probe_read_mode(void) {
-    pio_sm_put_blocking(pio0, PROBE_SM, fmt_probe_command(0, false, CMD_SKIP));
+    probe_queue_wait_tx();
+    pio_sm_put_blocking(probe->pio, probe->sm, fmt_probe_command(0, false, CMD_SKIP));
     probe_wait_idle();
 }
 
 void probe_write_mode(void) {
-    pio_sm_put_blocking(pio0, PROBE_SM, fmt_probe_command(0, true, CMD_SKIP));
+    probe_queue_wait_tx();
+    pio_sm_put_blocking(probe->pio, probe->sm, fmt_probe_command(0, true, CMD_SKIP));
     probe_wait_idle();
 }
 
-void probe_init() {
-    if (!probe.initted) {
-        uint offset = pio_add_program(pio0, &probe_program);
-        probe.offset = offset;
-
-        pio_sm_config sm_config = probe_program_get_default_config(offset);
-        probe_sm_init(&sm_config);
-        pio_sm_init(pio0, PROBE_SM, offset, &sm_config);
+// Load a program into the port's SM and set up the transaction engine DMA
+static void probe_load(const pio_program_t *program, uint entry, bool jtag) {
+    uint offset;
 
-        // Set up divisor
-        probe_set_swclk_freq(1000);
+    // The SWD program is shared by all ports, JTAG is only ever on port 0
+    if (jtag) {
+        offset = pio_add_program(probe->pio, program);
+    } else {
+        if (!swd_program_users++)
+            swd_program_offset = pio_add_program(probe->pio, program);
+        offset = swd_program_offset;
+    }
+    probe->offset = offset;
+    probe->jtag = jtag;
 
-        // Jump SM to command dispatch routine, and enable it
-        pio_sm_exec(pio0, PROBE_SM, offset + probe_offset_get_next_cmd);
-        pio_sm_set_enabled(pio0, PROBE_SM, 1);
-        probe.initted = 1;
+    pio_sm_config sm_config;
+#if defined(PROBE_PIN_TDI)
+    if (jtag) {
+        sm_config = probe_jtag_program_get_default_config(offset);
+        probe_jtag_sm_init(&sm_config);
+    } else
+#endif
+    {
+        sm_config = probe_program_get_default_config(offset);
+        probe_sm_init(&sm_config, probe->pio, probe->sm, probe->pin_offset);
     }
+    pio_sm_init(probe->pio, probe->sm, offset, &sm_config);
+
+    // Set up divisor
+    probe_set_swclk_freq(1000);
+
+    // Transaction engine DMA: TX streams command lists into the SM, RX collects read data
+    probe->tx_dma = dma_claim_unused_channel(true);
+    probe->rx_dma = dma_claim_unused_channel(true);
+
+    dma_channel_config dma_config = dma_channel_get_default_config(probe->tx_dma);
+    channel_config_set_transfer_data_size(&dma_config, DMA_SIZE_32);
+    channel_config_set_read_increment(&dma_config, true);
+    channel_config_set_write_increment(&dma_config, false);
+    channel_config_set_dreq(&dma_config, pio_get_dreq(probe->pio, probe->sm, true));
+    dma_channel_configure(probe->tx_dma, &dma_config, &probe->pio->txf[probe->sm], NULL, 0, false);
+
+    dma_config = dma_channel_get_default_config(probe->rx_dma);
+    channel_config_set_transfer_data_size(&dma_config, DMA_SIZE_32);
+    channel_config_set_read_increment(&dma_config, false);
+    channel_config_set_write_increment(&dma_config, true);
+    channel_config_set_dreq(&dma_config, pio_get_dreq(probe->pio, probe->sm, false));
+    dma_channel_configure(probe->rx_dma, &dma_config, NULL, &probe->pio->rxf[probe->sm], 0, false);
+    queue->tx_len = 0;
+    queue->rx_len = 0;
+
+    // Jump SM to command dispatch routine, and enable it
+    pio_sm_exec(probe->pio, probe->sm, pio_encode_jmp(offset + entry));
+    pio_sm_set_enabled(probe->pio, probe->sm, 1);
+    probe->initted = 1;
 }
 
+void probe_init() {
+    // SWD and JTAG programs don't both fit, switch over if JTAG was in use
+    if (probe->initted && probe->jtag)
+        probe_deinit();
+    if (!probe->initted)
+        probe_load(&probe_program, probe_offset_get_next_cmd, false);
+}
+
+#if defined(PROBE_PIN_TDI)
+void probe_jtag_init(void) {
+    if (probe->initted && !probe->jtag)
+        probe_deinit();
+    if (!probe->initted)
+        probe_load(&probe_jtag_program, probe_jtag_offset_get_next_cmd, true);
+}
+#endif
+
 void probe_deinit(void)
 {
-  if (probe.initted) {
-    probe_read_mode();
-    pio_sm_set_enabled(pio0, PROBE_SM, 0);
-    pio_remove_program(pio0, &probe_program, probe.offset);
-    probe.initted = 0;
+  if (probe->initted) {
+#if defined(PROBE_PIN_TDI)
+    if (probe->jtag) {
+      probe_queue_wait_tx();
+      pio_sm_set_enabled(probe->pio, probe->sm, 0);
+      // Let go of TCK, TMS and TDI
+      pio_sm_set_pindirs_with_mask(probe->pio, probe->sm, 0,
+                                   (1u << PROBE_PIN_TCK) | (1u << PROBE_PIN_TMS) | (1u << PROBE_PIN_TDI));
+      pio_remove_program(probe->pio, &probe_jtag_program, probe->offset);
+    } else
+#endif
+    {
+      probe_read_mode();
+      pio_sm_set_enabled(probe->pio, probe->sm, 0);
+      if (!--swd_program_users)
+        pio_remove_program(probe->pio, &probe_program, probe->offset);
+    }
+    dma_channel_unclaim(probe->tx_dma);
+    dma_channel_unclaim(probe->rx_dma);
+    probe->initted = 0;
   }
 }
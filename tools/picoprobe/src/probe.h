@@ -26,7 +26,29 @@
 #ifndef PROBE_H_
 #define PROBE_H_
 
-#if defined(PROBE_IO_RAW) || defined(PROBE_IO_SWDI)
+/*
+ * Boards may define PROBE_PORT1_PIN_OFFSET for a second SWD port on the next
+ * SM. Its pins are laid out as port 0's, starting at that offset instead of
+ * PROBE_PIN_OFFSET. JTAG is only available on port 0.
+ */
+#if defined(PROBE_PORT1_PIN_OFFSET)
+#define PROBE_PORTS 2
+#else
+#define PROBE_PORTS 1
+#endif
+
+#if (PROBE_PORTS > 1) && defined(PROBE_SWD_XFER) && defined(PROBE_PIN_TDI)
+#error "probe_swd and probe_jtag don't both fit in PIO0 alongside a second SWD port"
+#endif
+
+#define PROBE_PORT_PIN(pin, pin_offset) ((pin) - PROBE_PIN_OFFSET + (pin_offset))
+
+#if defined(PROBE_SWD_XFER)
+#if defined(PROBE_IO_OEN)
+#error "PROBE_SWD_XFER is only implemented for PROBE_IO_RAW and PROBE_IO_SWDI"
+#endif
+#include "probe_swd.pio.h"
+#elif defined(PROBE_IO_RAW) || defined(PROBE_IO_SWDI)
 #include "probe.pio.h"
 #endif
 
@@ -34,13 +56,61 @@
 #include "probe_oen.pio.h"
 #endif
 
-void probe_set_swclk_freq(uint freq_khz);
+#if defined(PROBE_PIN_TDI)
+#include "probe_jtag.pio.h"
+#endif
+
+// Select the port the functions below work on, 0..PROBE_PORTS-1
+void probe_set_port(uint port);
+uint probe_get_port(void);
+
+// Returns the frequency actually generated, the divider has 1/256 resolution
+uint probe_set_swclk_freq(uint freq_khz);
+uint probe_get_swclk_freq(void);
 
 // Bit counts in the range 1..256
 void probe_write_bits(uint bit_count, uint32_t data_byte);
 uint32_t probe_read_bits(uint bit_count);
 void probe_hiz_clocks(uint bit_count);
 
+/*
+ * Transaction engine. Commands are appended to a list with probe_queue_*()
+ * and streamed to the SM by DMA on probe_queue_run(), which returns once all
+ * queued reads have landed in rx (right-aligned, as from probe_read_bits)
+ * and returns how many did.
+ * probe_queue_start() and probe_queue_wait() are the two halves of
+ * probe_queue_run(), so the next list can be built while one is in flight.
+ * Only one list with reads may be outstanding at a time.
+ * Lists are limited to a handful of SWD transactions.
+ */
+void probe_queue_write(uint bit_count, uint32_t data);
+void probe_queue_read(uint bit_count);
+void probe_queue_hiz(uint bit_count);
+void probe_queue_start(uint32_t *rx);
+uint probe_queue_wait(void);
+uint probe_queue_run(uint32_t *rx);
+
+#if defined(PROBE_SWD_XFER)
+/*
+ * Queue a whole SWD request phase: header, turnaround and ACK. The ACK lands
+ * in rx as a status word. A non-OK ACK stops the SM, the rest of the list is
+ * dropped and probe_queue_run() returns the number of words received up to
+ * and including that status.
+ */
+void probe_queue_xfer(uint8_t header, uint turnaround);
+#endif
+
+#if defined(PROBE_PIN_TDI)
+/*
+ * JTAG runs through the same transaction engine, with probe_jtag loaded in
+ * place of the SWD program. Each command clocks 1..32 bits of TDI with TMS
+ * held, and its TDO bits always land in rx. A list holds up to 32 commands.
+ */
+#define PROBE_QUEUE_JTAG_MAX 32
+void probe_jtag_init(void);
+void probe_queue_jtag(uint bit_count, bool tms, uint32_t tdi);
+#endif
+
 void probe_read_mode(void);
 void probe_write_mode(void);
 
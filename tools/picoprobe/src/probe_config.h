@@ -29,36 +29,27 @@
 #include "FreeRTOS.h"
 #include "task.h"
 
-#if false
-#define probe_info(format,args...) \
-do { \
-	vTaskSuspendAll(); \
-	printf(format, ## args); \
-	xTaskResumeAll(); \
-} while (0)
+/*
+ * Debug output goes to a binary trace rather than through printf, so that it
+ * costs a few stores per call and can stay on at speed. See probe_trace.h.
+ */
+#if defined(PROBE_TRACE)
+#include "probe_trace.h"
+#define probe_info(format,args...) probe_trace(format, ## args)
 #else
 #define probe_info(format,...) ((void)0)
 #endif
 
 
-#if false
-#define probe_debug(format,args...) \
-do { \
-	vTaskSuspendAll(); \
-	printf(format, ## args); \
-	xTaskResumeAll(); \
-} while (0)
+#if defined(PROBE_TRACE)
+#define probe_debug(format,args...) probe_trace(format, ## args)
 #else
 #define probe_debug(format,...) ((void)0)
 #endif
 
+/* Every PIO transaction - enough to fill the ring in a few DAP commands */
 #if false
-#define probe_dump(format,args...)\
-do { \
-	vTaskSuspendAll(); \
-	printf(format, ## args); \
-	xTaskResumeAll(); \
-} while (0)
+#define probe_dump(format,args...) probe_trace(format, ## args)
 #else
 #define probe_dump(format,...) ((void)0)
 #endif
@@ -0,0 +1,447 @@
+/*
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2023 Raspberry Pi (Trading) Ltd.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ *
+ */
+
+#include <stdatomic.h>
+#include <pico/stdlib.h>
+
+#include "FreeRTOS.h"
+#include "task.h"
+#include "tusb.h"
+
+#include "DAP_config.h"
+#include "DAP.h"
+#include "probe_rtt.h"
+
+#if defined(PROBE_RTT)
+
+#if (PROBE_RTT_UP_SIZE & (PROBE_RTT_UP_SIZE - 1)) != 0
+#error "PROBE_RTT_UP_SIZE must be a power of 2"
+#endif
+
+/* How often probe_rtt_thread moves the rings to and from USB */
+#define PROBE_RTT_DRAIN_MS 1
+
+#define AP_CSW  0x00U
+#define AP_TAR  0x04U
+#define AP_DRW  0x0CU
+
+/* CSW size and auto-increment fields */
+#define CSW_MASK    0x3FU
+#define CSW_32      0x12U
+#define CSW_8       0x10U
+
+/* "SEGGER RTT" at the start of the control block */
+static const uint32_t rtt_id[3] = { 0x47474553U, 0x52205245U, 0x00005454U };
+
+/* Control block: ID, number of up and down buffers, then their descriptors */
+#define RTT_CB_NUM_UP   16U
+#define RTT_CB_DESC     24U
+/* Descriptor: name, then pBuffer, SizeOfBuffer, WrOff, RdOff, Flags */
+#define RTT_DESC_SIZE   24U
+#define RTT_DESC_BUF    4U
+#define RTT_DESC_WROFF  12U
+#define RTT_DESC_RDOFF  16U
+
+/* Single producer, single consumer, indices free-running */
+static struct {
+    uint8_t data[PROBE_RTT_UP_SIZE];
+    atomic_uint_least32_t wptr, rptr;
+} rtt_up;
+
+static struct {
+    uint8_t data[PROBE_RTT_DOWN_SIZE];
+    atomic_uint_least32_t wptr, rptr;
+} rtt_down;
+
+/* Only touched from the DAP thread */
+static struct {
+    enum probe_rtt_state state;
+    uint32_t search_addr;
+    uint32_t search_end;
+    uint32_t search_pos;
+    uint32_t interval_ms;
+    uint32_t port;          // SWD port the target is on
+    uint32_t up_ch;
+    uint32_t down_ch;
+    uint32_t cb;
+    uint32_t up_desc;       // 0 if the target has no such channel
+    uint32_t down_desc;
+    uint32_t csw;           // CSW for 32-bit accesses
+    uint32_t next_us;
+    uint32_t up_bytes;
+    uint32_t down_bytes;
+    uint32_t errors;
+} rtt;
+
+static uint8_t rtt_buf[PROBE_RTT_CHUNK + 8];
+
+static uint32_t rtt_get_u32(const uint8_t *p) {
+    return (uint32_t)p[0] | ((uint32_t)p[1] << 8) |
+           ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static bool rtt_xfer(uint32_t request, uint32_t *data) {
+    uint32_t retry = DAP_Data.transfer.retry_count;
+    uint8_t ack;
+
+    do {
+        ack = SWD_Transfer(request, data);
+    } while ((ack == DAP_TRANSFER_WAIT) && retry-- && !DAP_TransferAbort);
+    return ack == DAP_TRANSFER_OK;
+}
+
+static bool rtt_ap_read(uint32_t reg, uint32_t *val) {
+    return rtt_xfer(DAP_TRANSFER_APnDP | DAP_TRANSFER_RnW | reg, NULL) &&
+           rtt_xfer(DP_RDBUFF | DAP_TRANSFER_RnW, val);
+}
+
+static bool rtt_ap_write(uint32_t reg, uint32_t val) {
+    return rtt_xfer(DAP_TRANSFER_APnDP | reg, &val);
+}
+
+/* Read words into rtt_buf, a TAR auto-increment block (1 KiB) at a time */
+static bool mem_read(uint32_t addr, uint32_t words) {
+    uint8_t *p = rtt_buf;
+    uint32_t n, done;
+
+    while (words) {
+        n = MIN(words, (0x400U - (addr & 0x3FFU)) / 4U);
+        if (!rtt_ap_write(AP_TAR, addr) ||
+            !rtt_xfer(DAP_TRANSFER_APnDP | DAP_TRANSFER_RnW | AP_DRW, NULL))
+            return false;
+#if (DAP_SWD_READ_BLOCK != 0)
+        if (SWD_TransferReadBlock(DAP_TRANSFER_APnDP | DAP_TRANSFER_RnW | AP_DRW, p, n, &done) != DAP_TRANSFER_OK)
+            return false;
+#else
+        for (done = 0; done < n; done++) {
+            uint32_t val;
+
+            if (!rtt_xfer((done + 1U < n) ? (DAP_TRANSFER_APnDP | DAP_TRANSFER_RnW | AP_DRW) : (DP_RDBUFF | DAP_TRANSFER_RnW), &val))
+                return false;
+            p[4 * done + 0] = val;
+            p[4 * done + 1] = val >> 8;
+            p[4 * done + 2] = val >> 16;
+            p[4 * done + 3] = val >> 24;
+        }
+#endif
+        p += 4U * n;
+        addr += 4U * n;
+        words -= n;
+    }
+    return true;
+}
+
+static bool mem_write(uint32_t addr, uint32_t val) {
+    return rtt_ap_write(AP_TAR, addr) && rtt_ap_write(AP_DRW, val);
+}
+
+/* Byte accesses, so the bytes either side in the target's buffer are left alone */
+static bool mem_write_bytes(uint32_t addr, const uint8_t *data, uint32_t count) {
+    bool set_tar = true;
+
+    if (!rtt_ap_write(AP_CSW, (rtt.csw & ~CSW_MASK) | CSW_8))
+        return false;
+    for (; count; count--, addr++) {
+        if (set_tar || (addr & 0x3FFU) == 0U) {
+            if (!rtt_ap_write(AP_TAR, addr))
+                return false;
+            set_tar = false;
+        }
+        /* Data goes on the byte lane of the address */
+        if (!rtt_ap_write(AP_DRW, (uint32_t)*data++ << (8U * (addr & 3U))))
+            return false;
+    }
+    return rtt_ap_write(AP_CSW, rtt.csw);
+}
+
+static bool rtt_found(uint32_t cb) {
+    uint32_t num_up, num_down;
+
+    if (!mem_read(cb + RTT_CB_NUM_UP, 2U))
+        return false;
+    num_up = rtt_get_u32(&rtt_buf[0]);
+    num_down = rtt_get_u32(&rtt_buf[4]);
+    /* Not a real control block, or not initialised yet */
+    if (num_up > 255U || num_down > 255U)
+        return true;
+
+    rtt.cb = cb;
+    rtt.up_desc = (rtt.up_ch < num_up) ? cb + RTT_CB_DESC + RTT_DESC_SIZE * rtt.up_ch : 0U;
+    rtt.down_desc = (rtt.down_ch < num_down) ? cb + RTT_CB_DESC + RTT_DESC_SIZE * (num_up + rtt.down_ch) : 0U;
+    rtt.state = PROBE_RTT_RUNNING;
+    probe_info("RTT control block at %08x\n", cb);
+    return true;
+}
+
+/* Scan the next chunk of the search range for the control block's ID */
+static bool rtt_search(void) {
+    uint32_t n, i;
+
+    n = MIN(PROBE_RTT_CHUNK, rtt.search_end - rtt.search_pos) / 4U;
+    if (n < 3U) {
+        rtt.search_pos = rtt.search_addr;
+        return true;
+    }
+    if (!mem_read(rtt.search_pos, n))
+        return false;
+    for (i = 0; i + 3U <= n; i++) {
+        if (rtt_get_u32(&rtt_buf[4 * i]) == rtt_id[0] &&
+            rtt_get_u32(&rtt_buf[4 * i + 4]) == rtt_id[1] &&
+            rtt_get_u32(&rtt_buf[4 * i + 8]) == rtt_id[2]) {
+            rtt.search_pos += 4U * (i + 1U);
+            return rtt_found(rtt.search_pos - 4U);
+        }
+    }
+    /* Overlap chunks by two words, in case the ID straddles them */
+    rtt.search_pos += 4U * (n - 2U);
+    return true;
+}
+
+/* Copy what the target has written to the up buffer into rtt_up */
+static bool rtt_poll_up(void) {
+    uint32_t buf, size, wr, rd, n, skew, w, i;
+
+    if (!rtt.up_desc)
+        return true;
+    if (!mem_read(rtt.up_desc + RTT_DESC_BUF, 4U))
+        return false;
+    buf = rtt_get_u32(&rtt_buf[0]);
+    size = rtt_get_u32(&rtt_buf[4]);
+    wr = rtt_get_u32(&rtt_buf[8]);
+    rd = rtt_get_u32(&rtt_buf[12]);
+    if (size == 0U || wr >= size || rd >= size || wr == rd)
+        return true;
+
+    w = atomic_load_explicit(&rtt_up.wptr, memory_order_relaxed);
+    n = (wr > rd) ? wr - rd : size - rd;
+    n = MIN(n, PROBE_RTT_UP_SIZE - (w - atomic_load_explicit(&rtt_up.rptr, memory_order_acquire)));
+    n = MIN(n, PROBE_RTT_CHUNK);
+    if (n == 0U)
+        return true;
+
+    /* Whole words, from the one holding the first byte */
+    skew = (buf + rd) & 3U;
+    if (!mem_read(buf + rd - skew, (skew + n + 3U) / 4U))
+        return false;
+    for (i = 0; i < n; i++)
+        rtt_up.data[(w + i) % PROBE_RTT_UP_SIZE] = rtt_buf[skew + i];
+
+    rd += n;
+    if (rd == size)
+        rd = 0U;
+    if (!mem_write(rtt.up_desc + RTT_DESC_RDOFF, rd))
+        return false;
+    atomic_store_explicit(&rtt_up.wptr, w + n, memory_order_release);
+    rtt.up_bytes += n;
+    return true;
+}
+
+/* Copy rtt_down into the target's down buffer */
+static bool rtt_poll_down(void) {
+    uint32_t buf, size, wr, rd, n, r, i;
+
+    r = atomic_load_explicit(&rtt_down.rptr, memory_order_relaxed);
+    n = atomic_load_explicit(&rtt_down.wptr, memory_order_acquire) - r;
+    if (!rtt.down_desc || n == 0U)
+        return true;
+    if (!mem_read(rtt.down_desc + RTT_DESC_BUF, 4U))
+        return false;
+    buf = rtt_get_u32(&rtt_buf[0]);
+    size = rtt_get_u32(&rtt_buf[4]);
+    wr = rtt_get_u32(&rtt_buf[8]);
+    rd = rtt_get_u32(&rtt_buf[12]);
+    if (size == 0U || wr >= size || rd >= size)
+        return true;
+
+    /* One byte is always left free, so that full and empty differ */
+    n = MIN(n, (rd > wr) ? rd - wr - 1U : size - wr - (rd == 0U));
+    n = MIN(n, PROBE_RTT_CHUNK);
+    if (n == 0U)
+        return true;
+
+    for (i = 0; i < n; i++)
+        rtt_buf[i] = rtt_down.data[(r + i) % PROBE_RTT_DOWN_SIZE];
+    if (!mem_write_bytes(buf + wr, rtt_buf, n))
+        return false;
+    wr += n;
+    if (wr == size)
+        wr = 0U;
+    if (!mem_write(rtt.down_desc + RTT_DESC_WROFF, wr))
+        return false;
+    atomic_store_explicit(&rtt_down.rptr, r + n, memory_order_release);
+    rtt.down_bytes += n;
+    return true;
+}
+
+uint32_t probe_rtt_start(uint32_t addr, uint32_t size, uint32_t interval_ms,
+                         uint32_t up_channel, uint32_t down_channel) {
+    if (interval_ms == 0U)
+        return DAP_ERROR;
+    /* A zero size means addr is the control block itself */
+    if (size == 0U)
+        size = 12U;
+    rtt.search_addr = addr & ~3U;
+    rtt.search_end = addr + size;
+    rtt.search_pos = rtt.search_addr;
+    rtt.interval_ms = interval_ms;
+    rtt.port = probe_get_port();
+    rtt.up_ch = up_channel;
+    rtt.down_ch = down_channel;
+    rtt.cb = 0U;
+    rtt.up_bytes = 0U;
+    rtt.down_bytes = 0U;
+    rtt.errors = 0U;
+    rtt.next_us = time_us_32();
+    rtt.state = PROBE_RTT_SEARCHING;
+    return DAP_OK;
+}
+
+void probe_rtt_stop(void) {
+    rtt.state = PROBE_RTT_OFF;
+}
+
+enum probe_rtt_state probe_rtt_status(uint32_t *cb_addr, uint32_t *up_bytes,
+                                      uint32_t *down_bytes, uint32_t *errors) {
+    *cb_addr = rtt.cb;
+    *up_bytes = rtt.up_bytes;
+    *down_bytes = rtt.down_bytes;
+    *errors = rtt.errors;
+    return rtt.state;
+}
+
+/* Read CTRL/STAT, returning the DP ABORT bits that clear its sticky flags */
+static bool rtt_sticky(uint32_t *abort) {
+    uint32_t stat;
+
+    if (!rtt_xfer(DP_CTRL_STAT | DAP_TRANSFER_RnW, &stat))
+        return false;
+    *abort = 0U;
+    if (stat & (1U << 1))       // STICKYORUN
+        *abort |= 1U << 4;      // ORUNERRCLR
+    if (stat & (1U << 4))       // STICKYCMP
+        *abort |= 1U << 1;      // STKCMPCLR
+    if (stat & (1U << 5))       // STICKYERR
+        *abort |= 1U << 2;      // STKERRCLR
+    if (stat & (1U << 7))       // WDATAERR
+        *abort |= 1U << 3;      // WDERRCLR
+    return true;
+}
+
+/*
+ * Borrow AP 0, then put SELECT, CSW and TAR back for the host. The sticky
+ * flags belong to the host, so a poll only runs while they are all clear,
+ * and on failure it clears just those that the poll itself set.
+ */
+static void rtt_poll_port(void) {
+    uint32_t select, csw, tar, val;
+    bool ok;
+
+    select = swd_dp_select;
+    val = 0U;
+    if (!rtt_xfer(DP_SELECT, &val) || !rtt_sticky(&val) || val != 0U) {
+        rtt_xfer(DP_SELECT, &select);
+        return;
+    }
+    ok = rtt_ap_read(AP_CSW, &csw) &&
+         rtt_ap_read(AP_TAR, &tar);
+    if (ok) {
+        rtt.csw = (csw & ~CSW_MASK) | CSW_32;
+        ok = rtt_ap_write(AP_CSW, rtt.csw);
+        if (ok && rtt.state == PROBE_RTT_SEARCHING)
+            ok = rtt_search();
+        else if (ok)
+            ok = rtt_poll_up() && rtt_poll_down();
+        ok = rtt_ap_write(AP_CSW, csw) && rtt_ap_write(AP_TAR, tar) && ok;
+    }
+    if (!ok) {
+        /* Clear the sticky errors, and look for the control block again */
+        if (rtt_sticky(&val) && val != 0U)
+            rtt_xfer(DP_ABORT, &val);
+        rtt.errors++;
+        if (rtt.state == PROBE_RTT_RUNNING) {
+            rtt.state = PROBE_RTT_SEARCHING;
+            rtt.search_pos = rtt.search_addr;
+        }
+    }
+    rtt_xfer(DP_SELECT, &select);
+}
+
+uint32_t probe_rtt_poll(void) {
+    uint32_t now = time_us_32();
+    uint32_t port;
+
+    if (rtt.state == PROBE_RTT_OFF)
+        return 0U;
+    if ((int32_t)(rtt.next_us - now) > 0)
+        return (rtt.next_us - now + 999U) / 1000U;
+    rtt.next_us = now + rtt.interval_ms * 1000U;
+
+    /* The host may have moved on to another SWD port meanwhile */
+    port = probe_get_port();
+    if (port != rtt.port)
+        SWJ_SelectPort(rtt.port);
+    if (DAP_Data.debug_port == DAP_PORT_SWD)
+        rtt_poll_port();
+    if (port != rtt.port)
+        SWJ_SelectPort(port);
+    return rtt.interval_ms;
+}
+
+void probe_rtt_thread(void *ptr) {
+    uint32_t w, r, n;
+
+    while (1) {
+        vTaskDelay(pdMS_TO_TICKS(PROBE_RTT_DRAIN_MS));
+        if (!tud_cdc_n_connected(PROBE_RTT_CDC_ITF))
+            continue;
+
+        /* Target to host. The poller leaves data in the target while this is full. */
+        w = atomic_load_explicit(&rtt_up.wptr, memory_order_acquire);
+        r = atomic_load_explicit(&rtt_up.rptr, memory_order_relaxed);
+        while (w != r) {
+            n = MIN(w - r, PROBE_RTT_UP_SIZE - (r % PROBE_RTT_UP_SIZE));
+            n = tud_cdc_n_write(PROBE_RTT_CDC_ITF, &rtt_up.data[r % PROBE_RTT_UP_SIZE], n);
+            if (n == 0U)
+                break;
+            r += n;
+            atomic_store_explicit(&rtt_up.rptr, r, memory_order_release);
+        }
+        tud_cdc_n_write_flush(PROBE_RTT_CDC_ITF);
+
+        /* Host to target. What doesn't fit stays in the CDC FIFO, and so with the host. */
+        w = atomic_load_explicit(&rtt_down.wptr, memory_order_relaxed);
+        r = atomic_load_explicit(&rtt_down.rptr, memory_order_acquire);
+        while (tud_cdc_n_available(PROBE_RTT_CDC_ITF) && w - r < PROBE_RTT_DOWN_SIZE) {
+            n = MIN(PROBE_RTT_DOWN_SIZE - (w - r), PROBE_RTT_DOWN_SIZE - (w % PROBE_RTT_DOWN_SIZE));
+            n = tud_cdc_n_read(PROBE_RTT_CDC_ITF, &rtt_down.data[w % PROBE_RTT_DOWN_SIZE], n);
+            if (n == 0U)
+                break;
+            w += n;
+            atomic_store_explicit(&rtt_down.wptr, w, memory_order_release);
+        }
+    }
+}
+
+#endif
@@ -0,0 +1,78 @@
+/*
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2023 Raspberry Pi (Trading) Ltd.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ *
+ */
+
+#ifndef PROBE_RTT_H_
+#define PROBE_RTT_H_
+
+#include <stdint.h>
+
+/*
+ * SEGGER RTT style target logging, polled by the probe. Once started with
+ * vendor command 0x85, the DAP thread looks for the RTT control block in
+ * target RAM, then whenever it has no DAP commands to run and the poll
+ * interval is up, it copies one up buffer to a ring here and the down ring
+ * to one down buffer. probe_rtt_thread moves the rings to and from a CDC
+ * interface of their own. Polling stays on the SWD port that was selected when
+ * it started. Only AP 0 over SWD is supported, and the DP SELECT
+ * and AP 0 CSW/TAR registers are put back as the host left them. A failed
+ * transfer clears the sticky errors and starts the search again, in case the
+ * target was reset.
+ */
+
+/* CDC interfaces: 0 is the UART bridge, then the trace log if built in */
+#ifdef PROBE_TRACE
+#define PROBE_RTT_CDC_ITF 2
+#else
+#define PROBE_RTT_CDC_ITF 1
+#endif
+
+/* Ring sizes, powers of 2 */
+#ifndef PROBE_RTT_UP_SIZE
+#define PROBE_RTT_UP_SIZE 4096
+#endif
+#define PROBE_RTT_DOWN_SIZE 256
+
+/* Most target RAM read while searching, or moved per direction, in one poll */
+#define PROBE_RTT_CHUNK 256
+
+enum probe_rtt_state {
+    PROBE_RTT_OFF,
+    PROBE_RTT_SEARCHING,
+    PROBE_RTT_RUNNING,
+};
+
+uint32_t probe_rtt_start(uint32_t addr, uint32_t size, uint32_t interval_ms,
+                         uint32_t up_channel, uint32_t down_channel);
+void probe_rtt_stop(void);
+enum probe_rtt_state probe_rtt_status(uint32_t *cb_addr, uint32_t *up_bytes,
+                                      uint32_t *down_bytes, uint32_t *errors);
+
+/* Called from the DAP thread when idle. Returns ms until the next poll is due,
+ * 0 if polling is off. */
+uint32_t probe_rtt_poll(void);
+
+void probe_rtt_thread(void *ptr);
+
+#endif
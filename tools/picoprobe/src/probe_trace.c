@@ -0,0 +1,143 @@
+/*
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2023 Raspberry Pi (Trading) Ltd.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ *
+ */
+
+#include <stdarg.h>
+#include <pico/stdlib.h>
+#include <hardware/sync.h>
+
+#include "FreeRTOS.h"
+#include "task.h"
+#include "tusb.h"
+
+#include "probe_trace.h"
+
+#if defined(PROBE_TRACE)
+
+#if (PROBE_TRACE_RING_SIZE & (PROBE_TRACE_RING_SIZE - 1)) != 0
+#error "PROBE_TRACE_RING_SIZE must be a power of 2"
+#endif
+
+/* How often the drain thread looks at the rings */
+#define PROBE_TRACE_DRAIN_MS 10
+
+struct trace_rec {
+    const char *format;
+    uint32_t time_us;
+    uint32_t args[PROBE_TRACE_MAX_ARGS];
+    uint8_t nargs;
+};
+
+/* One ring per core. wptr is free-running and only written by its own core. */
+static struct {
+    struct trace_rec rec[PROBE_TRACE_RING_SIZE];
+    volatile uint32_t wptr;
+} trace_ring[NUM_CORES];
+
+void probe_trace_log(const char *format, unsigned int nargs, ...) {
+    uint core = get_core_num();
+    struct trace_rec *rec;
+    uint32_t save;
+    va_list ap;
+    uint i;
+
+    va_start(ap, nargs);
+    save = save_and_disable_interrupts();
+    rec = &trace_ring[core].rec[trace_ring[core].wptr % PROBE_TRACE_RING_SIZE];
+    rec->format = format;
+    rec->time_us = time_us_32();
+    rec->nargs = nargs;
+    for (i = 0; i < nargs; i++)
+        rec->args[i] = va_arg(ap, uint32_t);
+    __dmb();
+    trace_ring[core].wptr++;
+    restore_interrupts(save);
+    va_end(ap);
+}
+
+static uint8_t *trace_put_u32(uint8_t *p, uint32_t v) {
+    p[0] = v;
+    p[1] = v >> 8;
+    p[2] = v >> 16;
+    p[3] = v >> 24;
+    return p + 4;
+}
+
+void probe_trace_thread(void *ptr) {
+    static uint32_t rptr[NUM_CORES];
+    /* Header, format, time and arguments */
+    uint8_t buf[1 + 4 * (2 + PROBE_TRACE_MAX_ARGS)];
+    struct trace_rec rec;
+    uint32_t wptr, lost;
+    uint8_t *p;
+    uint core, i;
+
+    while (1) {
+        vTaskDelay(pdMS_TO_TICKS(PROBE_TRACE_DRAIN_MS));
+        if (!tud_cdc_n_connected(PROBE_TRACE_CDC_ITF))
+            continue;
+
+        /* Room for a loss report from each core as well as the record */
+        while (tud_cdc_n_write_available(PROBE_TRACE_CDC_ITF) >= sizeof(buf) + NUM_CORES * 5) {
+            /* Report anything overwritten, then send the older of the two cores' next records */
+            core = NUM_CORES;
+            for (i = 0; i < NUM_CORES; i++) {
+                wptr = trace_ring[i].wptr;
+                /* The slot at wptr may be being written, so at most SIZE - 1 are readable */
+                if (wptr - rptr[i] >= PROBE_TRACE_RING_SIZE) {
+                    lost = wptr - rptr[i] - (PROBE_TRACE_RING_SIZE - 1);
+                    rptr[i] += lost;
+                    buf[0] = PROBE_TRACE_LOST | (i << 3);
+                    trace_put_u32(&buf[1], lost);
+                    tud_cdc_n_write(PROBE_TRACE_CDC_ITF, buf, 5);
+                }
+                if (wptr != rptr[i] &&
+                    (core == NUM_CORES ||
+                     (int32_t)(trace_ring[i].rec[rptr[i] % PROBE_TRACE_RING_SIZE].time_us - rec.time_us) < 0)) {
+                    core = i;
+                    rec = trace_ring[i].rec[rptr[i] % PROBE_TRACE_RING_SIZE];
+                }
+            }
+            if (core == NUM_CORES)
+                break;
+
+            /* The other core may have started over this slot while it was copied */
+            __dmb();
+            if (trace_ring[core].wptr - rptr[core] >= PROBE_TRACE_RING_SIZE)
+                continue;
+            rptr[core]++;
+
+            p = buf;
+            *p++ = PROBE_TRACE_REC | (core << 3) | rec.nargs;
+            p = trace_put_u32(p, (uint32_t)rec.format);
+            p = trace_put_u32(p, rec.time_us);
+            for (i = 0; i < rec.nargs; i++)
+                p = trace_put_u32(p, rec.args[i]);
+            tud_cdc_n_write(PROBE_TRACE_CDC_ITF, buf, p - buf);
+        }
+        tud_cdc_n_write_flush(PROBE_TRACE_CDC_ITF);
+    }
+}
+
+#endif
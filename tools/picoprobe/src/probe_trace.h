@@ -0,0 +1,68 @@
+/*
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2023 Raspberry Pi (Trading) Ltd.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ *
+ */
+
+#ifndef PROBE_TRACE_H_
+#define PROBE_TRACE_H_
+
+#include <stdint.h>
+
+/*
+ * Binary event log. A record is the address of the format string, a
+ * microsecond timestamp and up to four 32-bit arguments - nothing is
+ * formatted on the probe. Each core writes its own ring, with interrupts
+ * masked for the few stores a record takes, so records can be logged from
+ * any task, interrupt or core 1. probe_trace_thread drains the rings,
+ * oldest record first, to a second CDC interface, and
+ * scripts/probe_trace.py turns the stream back into text using the ELF.
+ */
+
+/* CDC interface the trace goes out on. Interface 0 is the UART bridge. */
+#define PROBE_TRACE_CDC_ITF 1
+
+/* Records per core, a power of 2 */
+#ifndef PROBE_TRACE_RING_SIZE
+#define PROBE_TRACE_RING_SIZE 128
+#endif
+
+#define PROBE_TRACE_MAX_ARGS 4
+
+/* Stream framing: a header byte, then little-endian u32 fields */
+#define PROBE_TRACE_REC  0xa0   /* | core << 3 | nargs, then fmt, time, args */
+#define PROBE_TRACE_LOST 0xb0   /* | core << 3, then the number of records dropped */
+
+#define PROBE_TRACE_NARGS_(_0, _1, _2, _3, _4, _5, n, ...) n
+#define PROBE_TRACE_NARGS(...) PROBE_TRACE_NARGS_(0, ## __VA_ARGS__, 5, 4, 3, 2, 1, 0)
+
+#define probe_trace(format, args...) \
+do { \
+	_Static_assert(PROBE_TRACE_NARGS(args) <= PROBE_TRACE_MAX_ARGS, "too many trace arguments"); \
+	probe_trace_log(format, PROBE_TRACE_NARGS(args), ## args); \
+} while (0)
+
+/* Arguments must each fit in 32 bits */
+void probe_trace_log(const char *format, unsigned int nargs, ...);
+void probe_trace_thread(void *ptr);
+
+#endif
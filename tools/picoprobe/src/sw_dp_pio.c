@@ -24,15 +24,314 @@
  */
 
 #include <stdio.h>
+#include <string.h>
 
 #include "DAP_config.h"
 #include "DAP.h"
 #include "probe.h"
+#include "dap_stats.h"
 
-/* Slight hack - we're not bitbashing so we need to set baudrate off the DAP's delay cycles.
- * Ideally we don't want calls to udiv everywhere... */
-#define MAKE_KHZ(x) (CPU_CLOCK / (2000 * ((x) + 1)))
-volatile uint32_t cached_delay = 0;
+/* We're not bitbashing, so the DAP's delay cycles are too coarse to set the
+ * baudrate from. Use the requested frequency, and only reprogram the divider
+ * when it changes. */
+volatile uint32_t cached_freq = 0;
+uint32_t swd_dp_select;
+
+struct dap_xfer_stats dap_xfer_stats;
+
+#define AP_CSW  0x00U
+#define AP_TAR  0x04U
+#define AP_DRW  0x0CU
+#define AP_IDR  0x0CU   // In bank 0xF
+
+/* Request packet for each A[3:2] RnW APnDP: start, parity, stop and park
+ * bits included. */
+static const uint8_t swd_request[16] = {
+  0x81, 0xa3, 0xa5, 0x87, 0xa9, 0x8b, 0x8d, 0xaf,
+  0xb1, 0x93, 0x95, 0xb7, 0x99, 0xbb, 0xbd, 0x9f
+};
+
+/* A DP write to RDBUFF's address is TARGETSEL, which is not acknowledged */
+#define DP_TARGETSEL      0x0CU
+
+/* Targets per port whose DP state is kept across TARGETSEL switches */
+#define SWD_TARGETS       4U
+
+#define SWD_KNOWN_SELECT  0x01U
+#define SWD_KNOWN_CSW     0x02U
+#define SWD_KNOWN_TAR     0x04U
+#define SWD_KNOWN_IDR     0x08U   // An AP IDR read is posted
+#define SWD_KNOWN_SYNC    0x10U   // No AP access is posted, see swd_posted()
+
+/*
+ * DP state the probe knows for each target on a multi-drop bus, so a host
+ * switching between them finds SELECT and CSW as it left them. With
+ * PROBE_DP_CACHE, writes of the values already there are skipped. CSW and
+ * TAR are those of one MEM-AP, the last one whose CSW was written, and TAR
+ * follows the auto-increment of DRW accesses. The extra slot at SWD_TARGETS
+ * is whatever answers without a TARGETSEL: a single-drop target, or one
+ * selected in some way the probe didn't follow. A connect, an ABORT or a
+ * failed transfer other than a WAIT forgets what was known.
+ *
+ * In ADIv6 the same AP addresses are other registers, and CSW and TAR only
+ * mean anything on a MEM-AP. So they are only tracked once the host has read
+ * a DPIDR of DPv1 or DPv2, and the AP's IDR. That much is kept until a
+ * connect or a change of target.
+ *
+ * A dropped write is answered OK, but the real one might have got a FAULT
+ * for an earlier posted AP access. The host would then blame the wrong
+ * transfer. So writes are only dropped when no AP access is posted, which
+ * in practice is from the start of each DAP transfer command, as the last
+ * one ended with an RDBUFF read. Within a command, a write after an AP
+ * access is always sent.
+ */
+struct swd_target {
+  uint32_t targetsel;
+  uint32_t select;
+  uint32_t csw;
+  uint32_t tar;
+  uint32_t csw_select;    // SELECT the CSW was written through
+  uint32_t known;         // SWD_KNOWN_*
+  uint32_t idr_ap;        // APSEL of the posted IDR read
+  uint32_t mem_aps[8];    // One bit per APSEL whose IDR says MEM-AP
+  bool     adiv5;         // DPIDR said DPv1 or DPv2
+  bool     used;
+};
+
+static struct swd_target swd_targets[PROBE_PORTS][SWD_TARGETS + 1U];
+static uint32_t swd_target_next[PROBE_PORTS];
+static struct swd_target *swd_target = &swd_targets[0][SWD_TARGETS];
+
+static void swd_target_load (struct swd_target *target) {
+  swd_target = target;
+  swd_dp_select = target->select;
+}
+
+/* Carry on with no TARGETSEL, knowing nothing */
+static void swd_target_detach (void) {
+  struct swd_target *anon = &swd_targets[probe_get_port()][SWD_TARGETS];
+
+  memset(anon, 0, sizeof(*anon));
+  swd_target_load(anon);
+}
+
+// Forget the DP state of every target on the current port
+void swd_targets_forget (void) {
+  uint32_t port = probe_get_port();
+
+  memset(swd_targets[port], 0, sizeof(swd_targets[port]));
+  swd_target_next[port] = 0U;
+  swd_target_detach();
+}
+
+/* Switch the cache over to the target a TARGETSEL went to */
+static void swd_target_select (uint32_t targetsel) {
+  uint32_t port = probe_get_port();
+  struct swd_target *t = swd_targets[port];
+  uint32_t n;
+
+  for (n = 0U; n < SWD_TARGETS; n++) {
+    if (t[n].used && (t[n].targetsel == targetsel)) {
+      swd_target_load(&t[n]);
+      return;
+    }
+  }
+  /* Not seen since the last connect: a free slot, or the next in turn */
+  for (n = 0U; (n < SWD_TARGETS) && t[n].used; n++);
+  if (n == SWD_TARGETS) {
+    n = swd_target_next[port];
+    swd_target_next[port] = (n + 1U) % SWD_TARGETS;
+  }
+  memset(&t[n], 0, sizeof(t[n]));
+  t[n].used = true;
+  t[n].targetsel = targetsel;
+  swd_target_load(&t[n]);
+}
+
+/* Line resets and idle - a single run of ones - leave the DP state alone.
+ * A TARGETSEL hidden in any other sequence would not be followed, so stop
+ * relying on what is known. */
+static void swd_target_sequence (uint32_t count, const uint8_t *data) {
+  uint32_t edges = 0U;
+  uint32_t last = 0U;
+  uint32_t bit;
+  uint32_t n;
+
+  for (n = 0U; n < count; n++) {
+    bit = (data[n / 8U] >> (n % 8U)) & 1U;
+    if (bit != last) {
+      edges++;
+      last = bit;
+    }
+  }
+  if (edges > 2U) {
+    swd_target_detach();
+  }
+}
+
+static bool swd_mem_ap (uint32_t apsel) {
+  return (swd_target->mem_aps[apsel / 32U] & (1U << (apsel % 32U))) != 0U;
+}
+
+/* Is SELECT on bank 0 of the ADIv5 MEM-AP whose CSW is known? */
+static bool swd_ap_tracked (void) {
+  return ((swd_target->known & SWD_KNOWN_SELECT) != 0U) &&
+         ((swd_target->known & SWD_KNOWN_CSW) != 0U) &&
+         (swd_target->csw_select == (swd_dp_select & ~0xFU)) &&
+         swd_target->adiv5 && swd_mem_ap(swd_target->csw_select >> 24);
+}
+
+/* Follow whether an AP access that got an OK may still end in a FAULT.
+ * That shows on the next access, unless it is one that STICKYERR doesn't
+ * fault: a DPIDR, CTRL/STAT or RESEND read, or an ABORT write. */
+static void swd_posted (uint32_t request) {
+  uint32_t reg = request & (DAP_TRANSFER_APnDP | DAP_TRANSFER_A2 | DAP_TRANSFER_A3);
+
+  if ((request & DAP_TRANSFER_APnDP) != 0U) {
+    swd_target->known &= ~SWD_KNOWN_SYNC;
+  } else if ((request & DAP_TRANSFER_RnW) ? (reg == DP_RDBUFF) : (reg != DP_ABORT)) {
+    swd_target->known |= SWD_KNOWN_SYNC;
+  }
+}
+
+/* Does a write only put back what the register already holds? CSW and TAR
+ * are only tracked in ADIv5's AP bank 0, other AP registers may act on
+ * every write. */
+static bool swd_write_known (uint32_t request, uint32_t val) {
+#if defined(PROBE_DP_CACHE)
+  if ((swd_target->known & SWD_KNOWN_SYNC) == 0U) {
+    return false;
+  }
+  switch (request & (DAP_TRANSFER_APnDP | DAP_TRANSFER_A2 | DAP_TRANSFER_A3)) {
+    case DP_SELECT:
+      return ((swd_target->known & SWD_KNOWN_SELECT) != 0U) && (swd_target->select == val);
+    case DAP_TRANSFER_APnDP | AP_CSW:
+      return swd_ap_tracked() && (swd_target->csw == val);
+    case DAP_TRANSFER_APnDP | AP_TAR:
+      return swd_ap_tracked() && ((swd_target->known & SWD_KNOWN_TAR) != 0U) &&
+             (swd_target->tar == val);
+    default:
+      return false;
+  }
+#else
+  (void)request;
+  (void)val;
+  return false;
+#endif
+}
+
+/* Note what a write that got an OK left behind */
+static void swd_write_done (uint32_t request, uint32_t val) {
+  /* An AP write replaces any posted read result */
+  if (request & DAP_TRANSFER_APnDP) {
+    swd_target->known &= ~SWD_KNOWN_IDR;
+  }
+  switch (request & (DAP_TRANSFER_APnDP | DAP_TRANSFER_A2 | DAP_TRANSFER_A3)) {
+    case DP_ABORT:
+      swd_target->known = 0U;
+      break;
+    case DP_SELECT:
+      swd_dp_select = val;
+      swd_target->select = val;
+      swd_target->known |= SWD_KNOWN_SELECT;
+      break;
+    case DAP_TRANSFER_APnDP | AP_CSW:
+      if (((swd_target->known & SWD_KNOWN_SELECT) != 0U) && ((swd_dp_select & 0xF0U) == 0U)) {
+        /* A different AP's TAR is not known */
+        if (!swd_ap_tracked()) {
+          swd_target->known &= ~SWD_KNOWN_TAR;
+        }
+        swd_target->csw = val;
+        swd_target->csw_select = swd_dp_select & ~0xFU;
+        swd_target->known |= SWD_KNOWN_CSW;
+      }
+      break;
+    case DAP_TRANSFER_APnDP | AP_TAR:
+      if (swd_ap_tracked()) {
+        swd_target->tar = val;
+        swd_target->known |= SWD_KNOWN_TAR;
+      }
+      break;
+    default:
+      break;
+  }
+}
+
+/* Note the DP version and MEM-APs from a read that got an OK with good parity.
+ * An AP read returns the result of the one before it, as does RDBUFF. */
+static void swd_read_done (uint32_t request, uint32_t val) {
+  uint32_t reg = request & (DAP_TRANSFER_APnDP | DAP_TRANSFER_A2 | DAP_TRANSFER_A3);
+  uint32_t ap;
+
+  if ((reg == DP_RDBUFF) || ((reg & DAP_TRANSFER_APnDP) != 0U)) {
+    if ((swd_target->known & SWD_KNOWN_IDR) != 0U) {
+      ap = swd_target->idr_ap;
+      if (((val >> 13) & 0xFU) == 0x8U) {   // IDR.CLASS is MEM-AP
+        swd_target->mem_aps[ap / 32U] |= 1U << (ap % 32U);
+      } else {
+        swd_target->mem_aps[ap / 32U] &= ~(1U << (ap % 32U));
+      }
+      swd_target->known &= ~SWD_KNOWN_IDR;
+    }
+    if ((reg == (DAP_TRANSFER_APnDP | AP_IDR)) &&
+        ((swd_target->known & SWD_KNOWN_SELECT) != 0U) && ((swd_dp_select & 0xF0U) == 0xF0U)) {
+      swd_target->idr_ap = swd_dp_select >> 24;
+      swd_target->known |= SWD_KNOWN_IDR;
+    }
+  } else if (reg == DP_IDCODE) {
+    /* DPv3 has other registers here in other DP banks. DPIDR is the one
+     * with bit 0 set and a designer code. */
+    if ((((swd_target->known & SWD_KNOWN_SELECT) == 0U) || ((swd_dp_select & 0xFU) == 0U)) &&
+        ((val & 1U) != 0U) && ((val & 0xFFEU) != 0U)) {
+      swd_target->adiv5 = (((val >> 12) & 0xFU) == 1U) || (((val >> 12) & 0xFU) == 2U);
+    }
+  }
+}
+
+/* Follow TAR through a DRW access that got an OK. Single auto-increment is
+ * only defined within a 1 KiB block, and packed transfers aren't followed. */
+static void swd_drw_done (uint32_t request) {
+  uint32_t addr_inc = (swd_target->csw >> 4) & 0x3U;
+  uint32_t size = swd_target->csw & 0x7U;
+  uint32_t tar;
+
+  if (((request & (DAP_TRANSFER_APnDP | DAP_TRANSFER_A2 | DAP_TRANSFER_A3)) != (DAP_TRANSFER_APnDP | AP_DRW)) ||
+      !swd_ap_tracked() || ((swd_target->known & SWD_KNOWN_TAR) == 0U) || (addr_inc == 0U)) {
+    return;
+  }
+  tar = swd_target->tar + (1U << size);
+  if ((addr_inc == 1U) && (size <= 2U) && (((tar ^ swd_target->tar) & ~0x3FFU) == 0U)) {
+    swd_target->tar = tar;
+  } else {
+    swd_target->known &= ~SWD_KNOWN_TAR;
+  }
+}
+
+void swj_update_clock (void) {
+  if (DAP_Data.clock_freq != cached_freq) {
+    probe_set_swclk_freq(DAP_Data.clock_freq / 1000U);
+    cached_freq = DAP_Data.clock_freq;
+  }
+}
+
+/* Send a bit sequence, LSB of data[0] first, as one command list of 32-bit
+ * writes. It runs in the background like probe_write_bits(). */
+static void swj_write_sequence (uint32_t count, const uint8_t *data) {
+  uint32_t bits;
+  uint32_t val;
+  uint32_t n;
+
+  while (count > 0U) {
+    bits = (count > 32U) ? 32U : count;
+    val = 0U;
+    for (n = 0U; n < bits; n += 8U) {
+      val |= (uint32_t)*data++ << n;
+    }
+    probe_queue_write(bits, val);
+    count -= bits;
+  }
+  probe_queue_run(NULL);
+}
 
 // Generate SWJ Sequence
 //   count:  sequence bit count
@@ -40,23 +339,16 @@ volatile uint32_t cached_delay = 0;
 //   return: none
 #if ((DAP_SWD != 0) || (DAP_JTAG != 0))
 void SWJ_Sequence (uint32_t count, const uint8_t *data) {
-  uint32_t bits;
-  uint32_t n;
-
-  if (DAP_Data.clock_delay != cached_delay) {
-    probe_set_swclk_freq(MAKE_KHZ(DAP_Data.clock_delay));
-    cached_delay = DAP_Data.clock_delay;
+#if (DAP_JTAG != 0)
+  if (DAP_Data.debug_port == DAP_PORT_JTAG) {
+    JTAG_SWJ_Sequence(count, data);
+    return;
   }
+#endif
+  swj_update_clock();
   probe_debug("SWJ sequence count = %d FDB=0x%2x\n", count, data[0]);
-  n = count;
-  while (n > 0) {
-    if (n > 8)
-      bits = 8;
-    else
-      bits = n;
-    probe_write_bits(bits, *data++);
-    n -= bits;
-  }
+  swd_target_sequence(count, data);
+  swj_write_sequence(count, data);
 }
 #endif
 
@@ -67,144 +359,532 @@ void SWJ_Sequence (uint32_t count, const uint8_t *data) {
 //   return: none
 #if (DAP_SWD != 0)
 void SWD_Sequence (uint32_t info, const uint8_t *swdo, uint8_t *swdi) {
-  uint32_t bits;
-  uint32_t n;
+  /* Progress through a TARGETSEL sent as sequences: header, ACK, data */
+  static uint32_t targetsel_seq;
+  uint32_t rx[2];
+  uint32_t n, i;
 
-  if (DAP_Data.clock_delay != cached_delay) {
-    probe_set_swclk_freq(MAKE_KHZ(DAP_Data.clock_delay));
-    cached_delay = DAP_Data.clock_delay;
-  }
+  swj_update_clock();
   probe_debug("SWD sequence\n");
   n = info & SWD_SEQUENCE_CLK;
   if (n == 0U) {
     n = 64U;
   }
-  bits = n;
   if (info & SWD_SEQUENCE_DIN) {
-    while (n > 0) {
-      if (n > 8)
-        bits = 8;
-      else
-        bits = n;
-      *swdi++ = probe_read_bits(bits);
-      n -= bits;
-    }
+    targetsel_seq = (targetsel_seq == 1U) ? 2U : 0U;
+  } else if ((n == 8U) && (swdo[0] == swd_request[DP_TARGETSEL])) {
+    targetsel_seq = 1U;
+  } else if ((targetsel_seq == 2U) && (n >= 33U)) {
+    swd_target_select((uint32_t)swdo[0] | ((uint32_t)swdo[1] << 8) |
+                      ((uint32_t)swdo[2] << 16) | ((uint32_t)swdo[3] << 24));
+    targetsel_seq = 0U;
   } else {
-    while (n > 0) {
-      if (n > 8)
-        bits = 8;
-      else
-        bits = n;
-      probe_write_bits(bits, *swdo++);
-      n -= bits;
+    if (targetsel_seq != 0U) {
+      swd_target_detach();
+    }
+    swd_target_sequence(n, swdo);
+    targetsel_seq = 0U;
+  }
+  if (info & SWD_SEQUENCE_DIN) {
+    /* At most 64 bits: two 32-bit reads in one list */
+    probe_queue_read((n > 32U) ? 32U : n);
+    if (n > 32U) {
+      probe_queue_read(n - 32U);
+    }
+    probe_queue_run(rx);
+    for (i = 0U; i < (n + 7U) / 8U; i++) {
+      *swdi++ = (uint8_t)(rx[i / 4U] >> (8U * (i & 3U)));
     }
+  } else {
+    swj_write_sequence(n, swdo);
   }
 }
 #endif
 
 #if (DAP_SWD != 0)
+static inline uint32_t swd_parity (uint32_t val) {
+  val ^= val >> 16;
+  val ^= val >> 8;
+  val ^= val >> 4;
+  val ^= val >> 2;
+  val ^= val >> 1;
+  return val & 1U;
+}
+
+/* Queue everything after the ACK: data, parity, turnaround and idle cycles.
+ * Idle cycles (at most 255) are driven 0 and ride on the last write, as the
+ * SM clocks out 0 once a data entry's 32 bits are used up. */
+static void swd_queue_data_phase (uint32_t request, uint32_t val) {
+  uint32_t idle = DAP_Data.transfer.idle_cycles;
+
+  if (request & DAP_TRANSFER_RnW) {
+    /* Read RDATA[0:31] + parity, turnaround for line idle */
+    probe_queue_read(32);
+    probe_queue_read(1);
+    probe_queue_hiz(DAP_Data.swd_conf.turnaround);
+    if (idle) {
+      probe_queue_write(idle, 0);
+    }
+  } else {
+    /* Turnaround for write, then WDATA[0:31], then parity and idle */
+    probe_queue_hiz(DAP_Data.swd_conf.turnaround);
+    probe_queue_write(32, val);
+    probe_queue_write(1U + idle, swd_parity(val));
+  }
+}
+
+/* Finish off a transfer that didn't get an OK */
+static void swd_back_off (uint32_t request, uint32_t ack) {
+  if ((ack == DAP_TRANSFER_WAIT) || (ack == DAP_TRANSFER_FAULT)) {
+    if (DAP_Data.swd_conf.data_phase && ((request & DAP_TRANSFER_RnW) != 0U)) {
+      /* Dummy Read RDATA[0:31] + Parity */
+      probe_read_bits(33);
+    }
+    probe_hiz_clocks(DAP_Data.swd_conf.turnaround);
+    if (DAP_Data.swd_conf.data_phase && ((request & DAP_TRANSFER_RnW) == 0U)) {
+      /* Dummy Write WDATA[0:31] + Parity */
+      probe_write_bits(33, 0);
+    }
+    return;
+  }
+
+  /* Protocol error - back off data phase */
+  probe_read_bits(DAP_Data.swd_conf.turnaround + 32U + 1U);
+}
+
+/* TARGETSEL: no target drives the ACK, so clock past it and write anyway */
+static void swd_write_targetsel (uint32_t val) {
+  probe_queue_write(8, swd_request[DP_TARGETSEL]);
+  probe_queue_hiz(DAP_Data.swd_conf.turnaround + 3U);
+  swd_queue_data_phase(DP_TARGETSEL, val);
+  probe_queue_run(NULL);
+  swd_target_select(val);
+}
+
+/* Deal with a write that has no ACK to wait for: a TARGETSEL, or one that
+ * puts back what the register already holds and needn't be sent at all */
+static bool swd_write_unacked (uint32_t request, uint32_t val) {
+  if ((request & (DAP_TRANSFER_APnDP | DAP_TRANSFER_A2 | DAP_TRANSFER_A3)) == DP_TARGETSEL) {
+    swd_write_targetsel(val);
+    return true;
+  }
+  if (swd_write_known(request, val)) {
+    dap_xfer_stats.dropped++;
+    return true;
+  }
+  return false;
+}
+
 // SWD Transfer I/O
 //   request: A[3:2] RnW APnDP
 //   data:    DATA[31:0]
 //   return:  ACK[2:0]
 uint8_t SWD_Transfer (uint32_t request, uint32_t *data) {
-  uint8_t prq = 0;
+  uint8_t prq;
   uint8_t ack;
-  uint8_t bit;
+  uint32_t bit;
   uint32_t val = 0;
-  uint32_t parity = 0;
-  uint32_t n;
+  uint32_t rx[3];
+  uint32_t *rdata;
 
-  if (DAP_Data.clock_delay != cached_delay) {
-    probe_set_swclk_freq(MAKE_KHZ(DAP_Data.clock_delay));
-    cached_delay = DAP_Data.clock_delay;
-  }
+  swj_update_clock();
   probe_debug("SWD_transfer\n");
-  /* Generate the request packet */
-  prq |= (1 << 0); /* Start Bit */
-  for (n = 1; n < 5; n++) {
-    bit = (request >> (n - 1)) & 0x1;
-    prq |= bit << n;
-    parity += bit;
-  }
-  prq |= (parity & 0x1) << 5; /* Parity Bit */
-  prq |= (0 << 6); /* Stop Bit */
-  prq |= (1 << 7); /* Park bit */
-  probe_write_bits(8, prq);
-
-  /* Turnaround (ignore read bits) */
-  ack = probe_read_bits(DAP_Data.swd_conf.turnaround + 3);
-  ack >>= DAP_Data.swd_conf.turnaround;
+  prq = swd_request[request & 0xFU];
+  if ((request & DAP_TRANSFER_RnW) == 0U) {
+    val = *data;
+    if (swd_write_unacked(request, val)) {
+      if (request & DAP_TRANSFER_TIMESTAMP) {
+        DAP_Data.timestamp = time_us_32();
+      }
+      return DAP_TRANSFER_OK;
+    }
+  }
 
+#if defined(PROBE_SWD_XFER)
+  /* The SM checks the ACK and drops the data phase if it isn't OK */
+  probe_queue_xfer(prq, DAP_Data.swd_conf.turnaround);
+  swd_queue_data_phase(request, val);
+  probe_queue_run(rx);
+  ack = rx[0];
+  rdata = &rx[1];
+#else
+  /* Request and turnaround (ignore read bits) + ACK in one go */
+  probe_queue_write(8, prq);
+  probe_queue_read(DAP_Data.swd_conf.turnaround + 3);
+  probe_queue_run(rx);
+  ack = rx[0] >> DAP_Data.swd_conf.turnaround;
   if (ack == DAP_TRANSFER_OK) {
-    /* Data transfer phase */
+    /* Writes and idle cycles carry on in the background */
+    swd_queue_data_phase(request, val);
+    probe_queue_run(rx);
+  }
+  rdata = &rx[0];
+#endif
+
+  if (ack == DAP_TRANSFER_OK) {
+    swd_posted(request);
     if (request & DAP_TRANSFER_RnW) {
-      /* Read RDATA[0:31] - note probe_read shifts to LSBs */
-      val = probe_read_bits(32);
-      bit = probe_read_bits(1);
-      parity = __builtin_popcount(val);
-      if ((parity ^ bit) & 1U) {
-        /* Parity error */
+      val = rdata[0];
+      bit = rdata[1];
+      if (swd_parity(val) ^ bit) {
+        /* Parity error, so the read may not have been what it seemed */
         ack = DAP_TRANSFER_ERROR;
+        swd_target->known = 0U;
+      } else {
+        swd_read_done(request, val);
       }
       if (data)
         *data = val;
       probe_debug("Read %02x ack %02x 0x%08x parity %01x\n",
                       prq, ack, val, bit);
-      /* Turnaround for line idle */
-      probe_hiz_clocks(DAP_Data.swd_conf.turnaround);
     } else {
-      /* Turnaround for write */
-      probe_hiz_clocks(DAP_Data.swd_conf.turnaround);
-
-      /* Write WDATA[0:31] */
-      val = *data;
-      probe_write_bits(32, val);
-      parity = __builtin_popcount(val);
-      /* Write Parity Bit */
-      probe_write_bits(1, parity & 0x1);
       probe_debug("write %02x ack %02x 0x%08x parity %01x\n",
-                      prq, ack, val, parity);
+                      prq, ack, val, swd_parity(val));
+      swd_write_done(request, val);
     }
+    swd_drw_done(request);
     /* Capture Timestamp */
     if (request & DAP_TRANSFER_TIMESTAMP) {
       DAP_Data.timestamp = time_us_32();
     }
+    dap_count_ack(ack);
+    return ((uint8_t)ack);
+  }
 
-    /* Idle cycles - drive 0 for N clocks */
-    if (DAP_Data.transfer.idle_cycles) {
-      for (n = DAP_Data.transfer.idle_cycles; n; ) {
-        if (n > 256) {
-          probe_write_bits(256, 0);
-          n -= 256;
-        } else {
-          probe_write_bits(n, 0);
-          n -= n;
-        }
+  /* A WAIT left everything as it was */
+  if (ack != DAP_TRANSFER_WAIT) {
+    swd_target->known = 0U;
+  }
+  swd_back_off(request, ack);
+  dap_count_ack(ack);
+  return ((uint8_t)ack);
+}
+
+#if (DAP_SWD_READ_BLOCK != 0)
+// SWD register block read, pipelined
+//   request: A[3:2] RnW APnDP, the last read of an AP block goes to RDBUFF
+//   data:    response buffer, 4 bytes per register read
+//   count:   number of registers to read
+//   done:    number of registers read
+//   return:  ACK[2:0] of the last transfer
+//
+// The transfer for register N+1 is started before N is stored, so the SM
+// runs it while the CPU unpacks. A WAIT parks the SM before any of N+1's
+// data phase is clocked, so it is simply resent as SWD_Transfer() would be.
+uint8_t SWD_TransferReadBlock (uint32_t request, uint8_t *data, uint32_t count, uint32_t *done) {
+  uint32_t rx[2][3];
+  uint32_t cur = 0;
+  uint32_t req;
+  uint32_t retry;
+  uint32_t val;
+  uint8_t ack;
+
+  swj_update_clock();
+  probe_debug("SWD_transfer read block %d\n", count);
+  *done = 0U;
+  if (count == 0U) {
+    return DAP_TRANSFER_OK;
+  }
+
+  req = ((count == 1U) && (request & DAP_TRANSFER_APnDP)) ? (DP_RDBUFF | DAP_TRANSFER_RnW) : request;
+  probe_queue_xfer(swd_request[req & 0xFU], DAP_Data.swd_conf.turnaround);
+  swd_queue_data_phase(req, 0U);
+  probe_queue_start(rx[cur]);
+  retry = DAP_Data.transfer.retry_count;
+
+  while (1) {
+    probe_queue_wait();
+    ack = rx[cur][0];
+    if ((ack == DAP_TRANSFER_WAIT) && retry-- && !DAP_TransferAbort) {
+      dap_count_ack(ack);
+      swd_back_off(req, ack);
+      probe_queue_xfer(swd_request[req & 0xFU], DAP_Data.swd_conf.turnaround);
+      swd_queue_data_phase(req, 0U);
+      probe_queue_start(rx[cur]);
+      continue;
+    }
+    if (ack != DAP_TRANSFER_OK) {
+      if (ack != DAP_TRANSFER_WAIT) {
+        swd_target->known = 0U;
       }
+      dap_count_ack(ack);
+      swd_back_off(req, ack);
+      return ack;
     }
-    return ((uint8_t)ack);
+    swd_posted(req);
+    swd_drw_done(req);
+    val = rx[cur][1];
+    if (swd_parity(val) ^ rx[cur][2]) {
+      swd_target->known = 0U;
+      dap_count_ack(DAP_TRANSFER_ERROR);
+      return DAP_TRANSFER_ERROR;
+    }
+    swd_read_done(req, val);
+    dap_count_ack(ack);
+
+    /* Get the next register going before storing this one */
+    if (*done + 1U < count) {
+      req = ((*done + 2U == count) && (request & DAP_TRANSFER_APnDP)) ? (DP_RDBUFF | DAP_TRANSFER_RnW) : request;
+      probe_queue_xfer(swd_request[req & 0xFU], DAP_Data.swd_conf.turnaround);
+      swd_queue_data_phase(req, 0U);
+      probe_queue_start(rx[cur ^ 1U]);
+      retry = DAP_Data.transfer.retry_count;
+    }
+
+    *data++ = (uint8_t) val;
+    *data++ = (uint8_t)(val >>  8);
+    *data++ = (uint8_t)(val >> 16);
+    *data++ = (uint8_t)(val >> 24);
+    if (++*done == count) {
+      return DAP_TRANSFER_OK;
+    }
+    cur ^= 1U;
   }
+}
+#endif
 
-  if ((ack == DAP_TRANSFER_WAIT) || (ack == DAP_TRANSFER_FAULT)) {
-    if (DAP_Data.swd_conf.data_phase && ((request & DAP_TRANSFER_RnW) != 0U)) {
-      /* Dummy Read RDATA[0:31] + Parity */
-      probe_read_bits(33);
+// Get the SWCLK frequency actually generated, in kHz
+uint32_t SWJ_ClockGet (void) {
+  swj_update_clock();
+  return probe_get_swclk_freq();
+}
+
+#if (PROBE_PORTS > 1)
+/* DAP settings and connection state of the ports not in use */
+static DAP_Data_t swj_port_data[PROBE_PORTS];
+static struct swd_target *swj_port_target[PROBE_PORTS];
+static bool swj_port_used[PROBE_PORTS];
+#endif
+
+// Switch DAP commands to another SWD port
+//   port:   0 .. number of ports - 1
+//   return: number of ports, 0 if there is no such port
+//
+// Each port keeps its own DAP settings and connection, so the host can
+// connect to each target in turn and then switch freely between them.
+// A port's first use starts from the current port's settings, unconnected.
+uint32_t SWJ_SelectPort (uint32_t port) {
+  uint32_t cur = probe_get_port();
+
+  if (port >= PROBE_PORTS) {
+    return 0U;
+  }
+#if (PROBE_PORTS > 1)
+  if (port != cur) {
+    swj_port_data[cur] = DAP_Data;
+    swj_port_target[cur] = swd_target;
+    swj_port_used[cur] = true;
+    probe_set_port(port);
+    if (swj_port_used[port]) {
+      DAP_Data = swj_port_data[port];
+      swd_target_load(swj_port_target[port]);
+    } else {
+      DAP_Data.debug_port = DAP_PORT_DISABLED;
+      swd_targets_forget();
     }
-    probe_hiz_clocks(DAP_Data.swd_conf.turnaround);
-    if (DAP_Data.swd_conf.data_phase && ((request & DAP_TRANSFER_RnW) == 0U)) {
-      /* Dummy Write WDATA[0:31] + Parity */
-      probe_write_bits(32, 0);
-      probe_write_bits(1, 0);
+    /* The new port's SM has its own divider */
+    cached_freq = 0U;
+  }
+#else
+  (void)cur;
+#endif
+  return PROBE_PORTS;
+}
+
+static const uint32_t swj_clock_pattern[4] = {
+  0xFFFFFFFFU, 0x00000000U, 0xAAAAAAAAU, 0x5A5AA5A5U
+};
+
+static uint8_t swj_clock_xfer (uint32_t request, uint32_t *data) {
+  uint32_t retry = DAP_Data.transfer.retry_count;
+  uint8_t ack;
+
+  do {
+    ack = SWD_Transfer(request, data);
+  } while ((ack == DAP_TRANSFER_WAIT) && retry--);
+  return ack;
+}
+
+/* 56 clocks high, then idle */
+static void swj_line_reset (void) {
+  static const uint8_t line_reset[8] = {
+    0xFFU, 0xFFU, 0xFFU, 0xFFU, 0xFFU, 0xFFU, 0xFFU, 0x00U
+  };
+
+  swj_write_sequence(64U, line_reset);
+}
+
+/* Line reset, then TARGETSEL if the target is on a multi-drop bus */
+static void swj_line_reset_select (uint32_t targetsel) {
+  swj_line_reset();
+  if (targetsel != 0U) {
+    SWD_Transfer(DP_TARGETSEL, &targetsel);
+  }
+}
+
+/* Clear whichever sticky errors CTRL/STAT shows, and only those */
+static bool swj_clear_sticky (void) {
+  uint32_t stat, abort = 0U;
+
+  if (swj_clock_xfer(DP_CTRL_STAT | DAP_TRANSFER_RnW, &stat) != DAP_TRANSFER_OK) {
+    return false;
+  }
+  if (stat & (1U << 1)) {   // STICKYORUN
+    abort |= 1U << 4;       // ORUNERRCLR
+  }
+  if (stat & (1U << 4)) {   // STICKYCMP
+    abort |= 1U << 1;       // STKCMPCLR
+  }
+  if (stat & (1U << 5)) {   // STICKYERR
+    abort |= 1U << 2;       // STKERRCLR
+  }
+  if (stat & (1U << 7)) {   // WDATAERR
+    abort |= 1U << 3;       // WDERRCLR
+  }
+  if (abort == 0U) {
+    return true;
+  }
+  return swj_clock_xfer(DP_ABORT, &abort) == DAP_TRANSFER_OK;
+}
+
+/* Line reset and TARGETSEL, then check IDCODE and optionally write/read back
+ * a RAM pattern at the current SWCLK. Leaves SELECT pointing at AP 0 bank 0. */
+static bool swj_clock_test (uint32_t targetsel, uint32_t idcode, uint32_t csw, uint32_t ram_addr) {
+  uint32_t val;
+  uint32_t n;
+
+  swj_line_reset_select(targetsel);
+  if ((swj_clock_xfer(DP_IDCODE | DAP_TRANSFER_RnW, &val) != DAP_TRANSFER_OK) || (val != idcode)) {
+    return false;
+  }
+  /* CTRL/STAT is in DP bank 0. Clear any sticky errors left by a previous failed attempt. */
+  val = 0U;
+  if (swj_clock_xfer(DP_SELECT, &val) != DAP_TRANSFER_OK || !swj_clear_sticky()) {
+    return false;
+  }
+  if (ram_addr == 0U) {
+    return true;
+  }
+
+  if (swj_clock_xfer(DAP_TRANSFER_APnDP | AP_CSW, &csw) != DAP_TRANSFER_OK ||
+      swj_clock_xfer(DAP_TRANSFER_APnDP | AP_TAR, &ram_addr) != DAP_TRANSFER_OK) {
+    return false;
+  }
+  for (n = 0U; n < 4U; n++) {
+    val = swj_clock_pattern[n];
+    if (swj_clock_xfer(DAP_TRANSFER_APnDP | AP_DRW, &val) != DAP_TRANSFER_OK) {
+      return false;
+    }
+  }
+  if (swj_clock_xfer(DAP_TRANSFER_APnDP | AP_TAR, &ram_addr) != DAP_TRANSFER_OK ||
+      swj_clock_xfer(DAP_TRANSFER_APnDP | DAP_TRANSFER_RnW | AP_DRW, NULL) != DAP_TRANSFER_OK) {
+    return false;
+  }
+  /* AP reads are posted: each returns the previous one, RDBUFF the last */
+  for (n = 0U; n < 4U; n++) {
+    if (swj_clock_xfer((n < 3U) ? (DAP_TRANSFER_APnDP | DAP_TRANSFER_RnW | AP_DRW) : (DP_RDBUFF | DAP_TRANSFER_RnW), &val) != DAP_TRANSFER_OK ||
+        val != swj_clock_pattern[n]) {
+      return false;
     }
-    return ((uint8_t)ack);
   }
+  return true;
+}
 
-  /* Protocol error */
-  n = DAP_Data.swd_conf.turnaround + 32U + 1U;
-  /* Back off data phase */
-  probe_read_bits(n);
-  return ((uint8_t)ack);
+// Find the highest SWCLK at which the attached target reads back cleanly
+//   min_khz:  known good frequency to start from
+//   max_khz:  upper limit of the search
+//   ram_addr: word aligned RAM address for a 16-byte pattern test, 0 to skip
+//   targetsel: TARGETSEL of a multi-drop target, sent after each line reset, 0 if none
+//   idcode:   DP IDCODE read at min_khz
+//   return:   highest passing SWCLK actually generated in kHz, 0 if min_khz fails
+//
+// The RAM under test is overwritten, and SELECT and the AP's CSW/TAR are left
+// changed, so hosts must not rely on cached DP/AP state across this command.
+// The DAP's own SWJ clock setting is reapplied afterwards.
+uint32_t SWJ_ClockSearch (uint32_t min_khz, uint32_t max_khz, uint32_t ram_addr, uint32_t targetsel, uint32_t *idcode) {
+  uint32_t lo, hi, mid;
+  uint32_t csw = 0U;
+  uint32_t best;
+
+  *idcode = 0U;
+  if (DAP_Data.debug_port != DAP_PORT_SWD || min_khz == 0U || max_khz < min_khz) {
+    return 0U;
+  }
+  probe_info("SWCLK search %d..%dkHz\n", min_khz, max_khz);
+
+  /* Keep SWD_Transfer() from reapplying the DAP clock while we sweep */
+  swj_update_clock();
+
+  /* Reference IDCODE and CSW at the known good speed */
+  lo = probe_set_swclk_freq(min_khz);
+  swj_line_reset_select(targetsel);
+  if (swj_clock_xfer(DP_IDCODE | DAP_TRANSFER_RnW, idcode) != DAP_TRANSFER_OK) {
+    best = 0U;
+    goto out;
+  }
+  if (ram_addr != 0U) {
+    csw = 0U;
+    if (swj_clock_xfer(DP_SELECT, &csw) != DAP_TRANSFER_OK ||
+        swj_clock_xfer(DAP_TRANSFER_APnDP | DAP_TRANSFER_RnW | AP_CSW, NULL) != DAP_TRANSFER_OK ||
+        swj_clock_xfer(DP_RDBUFF | DAP_TRANSFER_RnW, &csw) != DAP_TRANSFER_OK) {
+      best = 0U;
+      goto out;
+    }
+    /* 32-bit accesses, single auto-increment */
+    csw = (csw & ~0x3FU) | 0x12U;
+  }
+  if (!swj_clock_test(targetsel, *idcode, csw, ram_addr)) {
+    best = 0U;
+    goto out;
+  }
+  best = lo;
+
+  hi = probe_set_swclk_freq(max_khz);
+  if (swj_clock_test(targetsel, *idcode, csw, ram_addr)) {
+    best = hi;
+    goto out;
+  }
+
+  /* Bisect down to ~1% */
+  lo = min_khz;
+  hi = max_khz;
+  while ((hi - lo) > (lo / 100U + 1U)) {
+    mid = lo + (hi - lo) / 2U;
+    mid = probe_set_swclk_freq(mid);
+    if (swj_clock_test(targetsel, *idcode, csw, ram_addr)) {
+      lo = mid;
+      best = mid;
+    } else {
+      hi = mid;
+    }
+  }
+
+out:
+  /* Back to the host's clock, with the DP left in a sane state */
+  probe_info("SWCLK search best %dkHz IDCODE %08x\n", best, *idcode);
+  cached_freq = 0U;
+  swj_update_clock();
+  swj_line_reset_select(targetsel);
+  swj_clock_xfer(DP_IDCODE | DAP_TRANSFER_RnW, NULL);
+  return best;
+}
+
+// Select a target on a multi-drop SWD bus
+//   targetsel: TARGETSEL value of the target
+//   dpidr:     DPIDR read from it
+//   return:    ACK[2:0] of the DPIDR read
+//
+// Line reset, TARGETSEL and a DPIDR read in one go. What the probe knows of
+// the target's SELECT and CSW since it was last selected still holds, so
+// the host's writes of the same values are dropped.
+uint32_t SWD_SelectTarget (uint32_t targetsel, uint32_t *dpidr) {
+  *dpidr = 0U;
+  if (DAP_Data.debug_port != DAP_PORT_SWD) {
+    return DAP_TRANSFER_ERROR;
+  }
+  swj_update_clock();
+  swj_line_reset_select(targetsel);
+  return swj_clock_xfer(DP_IDCODE | DAP_TRANSFER_RnW, dpidr);
 }
 
 #endif  /* (DAP_SWD != 0) */
@@ -0,0 +1,264 @@
+/*
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2023 Raspberry Pi (Trading) Ltd.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ *
+ */
+
+#include <pico/stdlib.h>
+#include <hardware/clocks.h>
+#include <hardware/dma.h>
+#include <hardware/irq.h>
+#include <hardware/pio.h>
+
+#include "probe_config.h"
+#include "DAP_config.h"
+
+#if (SWO_UART != 0)
+
+#include "Driver_USART.h"
+#include "swo.pio.h"
+
+/*
+ * SWO capture for CMSIS-DAP's SWO.c, which drives trace capture through a
+ * CMSIS USART driver. This is that driver, receive only, with a PIO state
+ * machine doing the NRZ or Manchester decode and DMA moving the bytes into
+ * the trace buffer. The decoders push each byte in bits 31:24, so DMA reads
+ * the top byte lane of the RX FIFO.
+ */
+#define SWO_PIO pio1
+#define SWO_SM 0
+/* Raised by swo_uart on a bad stop bit */
+#define SWO_PIO_IRQ_FRAMING 4
+
+static struct {
+    ARM_USART_SignalEvent_t cb_event;
+    const pio_program_t *program;
+    uint offset;
+    uint dma;
+    uint32_t rx_num;
+    bool powered;
+} swo;
+
+static ARM_DRIVER_VERSION swo_get_version(void) {
+    return (ARM_DRIVER_VERSION) { ARM_USART_API_VERSION, ARM_DRIVER_VERSION_MAJOR_MINOR(1, 0) };
+}
+
+static ARM_USART_CAPABILITIES swo_get_capabilities(void) {
+    return (ARM_USART_CAPABILITIES) {
+        .asynchronous = 1,
+        .event_rx_timeout = 0,
+    };
+}
+
+static void swo_dma_irq(void) {
+    uint32_t event = ARM_USART_EVENT_RECEIVE_COMPLETE;
+
+    if (!swo.powered || !dma_channel_get_irq1_status(swo.dma))
+        return;
+    dma_channel_acknowledge_irq1(swo.dma);
+
+    // The state machine stalled on a full FIFO, so bytes were lost
+    if (SWO_PIO->fdebug & (1u << (PIO_FDEBUG_RXSTALL_LSB + SWO_SM))) {
+        SWO_PIO->fdebug = 1u << (PIO_FDEBUG_RXSTALL_LSB + SWO_SM);
+        event |= ARM_USART_EVENT_RX_OVERFLOW;
+    }
+    if (pio_interrupt_get(SWO_PIO, SWO_PIO_IRQ_FRAMING)) {
+        pio_interrupt_clear(SWO_PIO, SWO_PIO_IRQ_FRAMING);
+        event |= ARM_USART_EVENT_RX_FRAMING_ERROR;
+    }
+    if (swo.cb_event)
+        swo.cb_event(event);
+}
+
+static int32_t swo_initialize(ARM_USART_SignalEvent_t cb_event) {
+    swo.cb_event = cb_event;
+    return ARM_DRIVER_OK;
+}
+
+static void swo_unload(void) {
+    pio_sm_set_enabled(SWO_PIO, SWO_SM, false);
+    if (swo.program) {
+        pio_remove_program(SWO_PIO, swo.program, swo.offset);
+        swo.program = NULL;
+    }
+}
+
+static int32_t swo_power_control(ARM_POWER_STATE state) {
+    dma_channel_config c;
+
+    switch (state) {
+    case ARM_POWER_FULL:
+        if (swo.powered)
+            return ARM_DRIVER_OK;
+        pio_sm_claim(SWO_PIO, SWO_SM);
+        swo.dma = dma_claim_unused_channel(true);
+        c = dma_channel_get_default_config(swo.dma);
+        channel_config_set_transfer_data_size(&c, DMA_SIZE_8);
+        channel_config_set_read_increment(&c, false);
+        channel_config_set_write_increment(&c, true);
+        channel_config_set_dreq(&c, pio_get_dreq(SWO_PIO, SWO_SM, false));
+        dma_channel_configure(swo.dma, &c, NULL, (uint8_t *)&SWO_PIO->rxf[SWO_SM] + 3, 0, false);
+        dma_channel_set_irq1_enabled(swo.dma, true);
+        swo.powered = true;
+        return ARM_DRIVER_OK;
+    case ARM_POWER_OFF:
+        if (!swo.powered)
+            return ARM_DRIVER_OK;
+        swo_unload();
+        dma_channel_set_irq1_enabled(swo.dma, false);
+        dma_channel_abort(swo.dma);
+        dma_channel_unclaim(swo.dma);
+        pio_sm_unclaim(SWO_PIO, SWO_SM);
+        gpio_set_function(PROBE_PIN_SWO, GPIO_FUNC_NULL);
+        swo.powered = false;
+        return ARM_DRIVER_OK;
+    default:
+        return ARM_DRIVER_ERROR_UNSUPPORTED;
+    }
+}
+
+static int32_t swo_uninitialize(void) {
+    swo_power_control(ARM_POWER_OFF);
+    swo.cb_event = NULL;
+    return ARM_DRIVER_OK;
+}
+
+/* (Re)load a decoder, with the state machine clocked at cycles_per_bit x baudrate */
+static int32_t swo_load(const pio_program_t *program, uint cycles_per_bit, uint32_t baudrate) {
+    uint64_t divider;
+
+    if (!swo.powered)
+        return ARM_DRIVER_ERROR;
+    if (baudrate == 0)
+        return ARM_USART_ERROR_BAUDRATE;
+    // 16.8 fixed point divider, rounded to nearest
+    divider = ((uint64_t)clock_get_hz(clk_sys) * 256 + cycles_per_bit * baudrate / 2) / (cycles_per_bit * baudrate);
+    if (divider < 0x100 || divider > 0xffffff)
+        return ARM_USART_ERROR_BAUDRATE;
+
+    if (swo.program != program) {
+        swo_unload();
+        if (!pio_can_add_program(SWO_PIO, program))
+            return ARM_DRIVER_ERROR;
+        swo.offset = pio_add_program(SWO_PIO, program);
+        swo.program = program;
+    }
+    pio_sm_set_enabled(SWO_PIO, SWO_SM, false);
+    if (program == &swo_uart_program)
+        swo_uart_program_init(SWO_PIO, SWO_SM, swo.offset, PROBE_PIN_SWO);
+    else
+        swo_manchester_program_init(SWO_PIO, SWO_SM, swo.offset, PROBE_PIN_SWO);
+    pio_sm_set_clkdiv_int_frac(SWO_PIO, SWO_SM, divider >> 8, divider & 0xff);
+    probe_info("SWO %s %u baud\n", program == &swo_uart_program ? "UART" : "Manchester", baudrate);
+    return ARM_DRIVER_OK;
+}
+
+static int32_t swo_send(const void *data, uint32_t num) {
+    return ARM_DRIVER_ERROR_UNSUPPORTED;
+}
+
+static int32_t swo_receive(void *data, uint32_t num) {
+    if (!swo.program)
+        return ARM_DRIVER_ERROR;
+    if (dma_channel_is_busy(swo.dma))
+        return ARM_DRIVER_ERROR_BUSY;
+    swo.rx_num = num;
+    dma_channel_transfer_to_buffer_now(swo.dma, data, num);
+    return ARM_DRIVER_OK;
+}
+
+static int32_t swo_transfer(const void *data_out, void *data_in, uint32_t num) {
+    return ARM_DRIVER_ERROR_UNSUPPORTED;
+}
+
+static uint32_t swo_get_tx_count(void) {
+    return 0;
+}
+
+static uint32_t swo_get_rx_count(void) {
+    return swo.rx_num - dma_channel_hw_addr(swo.dma)->transfer_count;
+}
+
+static int32_t swo_control(uint32_t control, uint32_t arg) {
+    switch (control & ARM_USART_CONTROL_Msk) {
+    case ARM_USART_MODE_ASYNCHRONOUS:
+        if ((control & ~ARM_USART_CONTROL_Msk) !=
+            (ARM_USART_DATA_BITS_8 | ARM_USART_PARITY_NONE | ARM_USART_STOP_BITS_1))
+            return ARM_USART_ERROR_MODE;
+        return swo_load(&swo_uart_program, 8, arg);
+    case SWO_USART_MODE_MANCHESTER:
+        return swo_load(&swo_manchester_program, 16, arg);
+    case ARM_USART_CONTROL_RX:
+        if (!swo.program)
+            return ARM_DRIVER_ERROR;
+        if (arg) {
+            pio_interrupt_clear(SWO_PIO, SWO_PIO_IRQ_FRAMING);
+            SWO_PIO->fdebug = 1u << (PIO_FDEBUG_RXSTALL_LSB + SWO_SM);
+        }
+        pio_sm_set_enabled(SWO_PIO, SWO_SM, arg != 0);
+        return ARM_DRIVER_OK;
+    case ARM_USART_ABORT_RECEIVE:
+        if (swo.powered)
+            dma_channel_abort(swo.dma);
+        return ARM_DRIVER_OK;
+    default:
+        return ARM_DRIVER_ERROR_UNSUPPORTED;
+    }
+}
+
+static ARM_USART_STATUS swo_get_status(void) {
+    return (ARM_USART_STATUS) {
+        .rx_busy = swo.powered && dma_channel_is_busy(swo.dma),
+    };
+}
+
+static int32_t swo_set_modem_control(ARM_USART_MODEM_CONTROL control) {
+    return ARM_DRIVER_ERROR_UNSUPPORTED;
+}
+
+static ARM_USART_MODEM_STATUS swo_get_modem_status(void) {
+    return (ARM_USART_MODEM_STATUS) { 0 };
+}
+
+void swo_pio_init(void) {
+    irq_add_shared_handler(DMA_IRQ_1, swo_dma_irq, PICO_SHARED_IRQ_HANDLER_DEFAULT_ORDER_PRIORITY);
+    irq_set_enabled(DMA_IRQ_1, true);
+}
+
+ARM_DRIVER_USART Driver_USART0 = {
+    swo_get_version,
+    swo_get_capabilities,
+    swo_initialize,
+    swo_uninitialize,
+    swo_power_control,
+    swo_send,
+    swo_receive,
+    swo_transfer,
+    swo_get_tx_count,
+    swo_get_rx_count,
+    swo_control,
+    swo_get_status,
+    swo_set_modem_control,
+    swo_get_modem_status,
+};
+
+#endif
@@ -0,0 +1,98 @@
+/*
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2023 Raspberry Pi (Trading) Ltd.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ *
+ */
+
+#include <stddef.h>
+
+#include "task_stats.h"
+#if (configUSE_TIMERS != 0)
+#include "timers.h"
+#endif
+
+/* UART, TUD, DAP, SWO, Trace and RTT */
+#define TASK_STATS_MAX 8
+
+static struct {
+    TaskHandle_t task;
+    uint32_t stack_depth;
+} tasks[TASK_STATS_MAX];
+static uint32_t ntasks;
+
+void task_stats_add(TaskHandle_t task, uint32_t stack_depth) {
+    if (task && ntasks < TASK_STATS_MAX) {
+        tasks[ntasks].task = task;
+        tasks[ntasks].stack_depth = stack_depth;
+        ntasks++;
+    }
+}
+
+uint32_t task_stats_count(void) {
+    return ntasks + 1 + (configUSE_TIMERS != 0);
+}
+
+bool task_stats_get(uint32_t index, struct task_stats *stats) {
+    TaskStatus_t status;
+    TaskHandle_t task;
+    uint32_t depth;
+
+    if (index < ntasks) {
+        task = tasks[index].task;
+        depth = tasks[index].stack_depth;
+    } else if (index == ntasks) {
+        task = xTaskGetIdleTaskHandle();
+        depth = configMINIMAL_STACK_SIZE;
+#if (configUSE_TIMERS != 0)
+    } else if (index == ntasks + 1) {
+        task = xTimerGetTimerDaemonTaskHandle();
+        depth = configTIMER_TASK_STACK_DEPTH;
+#endif
+    } else {
+        return false;
+    }
+
+    /* The state isn't reported, so don't have vTaskGetInfo look it up */
+    vTaskGetInfo(task, &status, pdTRUE, eRunning);
+    stats->name = status.pcTaskName;
+    stats->stack_bytes = depth * sizeof(StackType_t);
+    stats->stack_unused = status.usStackHighWaterMark * sizeof(StackType_t);
+    stats->run_time_us = status.ulRunTimeCounter;
+    stats->priority = status.uxCurrentPriority;
+    return true;
+}
+
+uint32_t task_stats_heap_free(void) {
+#if (configSUPPORT_DYNAMIC_ALLOCATION != 0)
+    return xPortGetFreeHeapSize();
+#else
+    return 0;
+#endif
+}
+
+uint32_t task_stats_sram_free(void) {
+    /* The C heap grows up from the end of .bss, and may take all of RAM up to __StackLimit */
+    extern char __StackLimit;
+    extern void *_sbrk(int incr);
+
+    return (uint32_t)(&__StackLimit - (char *)_sbrk(0));
+}
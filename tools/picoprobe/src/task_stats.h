@@ -0,0 +1,61 @@
+/*
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2023 Raspberry Pi (Trading) Ltd.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ *
+ */
+
+#ifndef TASK_STATS_H
+#define TASK_STATS_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "FreeRTOS.h"
+#include "task.h"
+
+/*
+ * Stack and CPU use of the FreeRTOS tasks, for the host to read back with a
+ * vendor command. Run time is counted by the 1 MHz system timer and
+ * free-runs, like the DAP counters.
+ */
+
+struct task_stats {
+    const char *name;
+    uint32_t stack_bytes;   // Size of the task's stack
+    uint32_t stack_unused;  // Bytes of it that have never been used
+    uint32_t run_time_us;
+    uint8_t priority;
+};
+
+/* Record a task created by the application, with its stack depth in words */
+void task_stats_add(TaskHandle_t task, uint32_t stack_depth);
+
+/* Application tasks in the order added, then the idle and timer tasks */
+uint32_t task_stats_count(void);
+bool task_stats_get(uint32_t index, struct task_stats *stats);
+
+/* FreeRTOS heap left, 0 in a static allocation build */
+uint32_t task_stats_heap_free(void);
+/* SRAM between the C heap and the top of RAM, where larger buffers could go */
+uint32_t task_stats_sram_free(void);
+
+#endif
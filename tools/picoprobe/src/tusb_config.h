@@ -63,7 +63,14 @@
 
 //------------- CLASS -------------//
 #define CFG_TUD_HID             1
+// The UART bridge, then the binary trace log and RTT if built in
+#if defined(PROBE_TRACE) && defined(PROBE_RTT)
+#define CFG_TUD_CDC             3
+#elif defined(PROBE_TRACE) || defined(PROBE_RTT)
+#define CFG_TUD_CDC             2
+#else
 #define CFG_TUD_CDC             1
+#endif
 #define CFG_TUD_MSC             0
 #define CFG_TUD_MIDI            0
 #define CFG_TUD_VENDOR          1
@@ -6,20 +6,104 @@
 
 #include "tusb_edpt_handler.h"
 #include "DAP.h"
+#include "dap_stats.h"
+#ifdef PROBE_RTT
+#include "probe_rtt.h"
+#endif
+
+#include <pico/critical_section.h>
+#if (PROBE_DAP_CORE1 != 0)
+#include <pico/sem.h>
+#include <hardware/sync.h>
+#endif
 
 static uint8_t itf_num;
 static uint8_t _rhport;
 
-volatile uint32_t _resp_len;
-
 static uint8_t _out_ep_addr;
 static uint8_t _in_ep_addr;
+static uint8_t _swo_ep_addr;
+static uint16_t _out_ep_size;
+static uint16_t _in_ep_size;
+
+// Bytes of the current request received so far, and whether the IN endpoint owes the host a ZLP
+static uint16_t _out_rx_len;
+static bool _in_zlp;
 
 static buffer_t USBRequestBuffer;
 static buffer_t USBResponseBuffer;
 
-static uint8_t DAPRequestBuffer[DAP_PACKET_SIZE];
-static uint8_t DAPResponseBuffer[DAP_PACKET_SIZE];
+struct dap_cmd_stats dap_cmd_stats[256];
+struct dap_ring_stats dap_ring_stats;
+
+/*
+ * req_full is counted by the USB thread, so dap_stats_clear() on the DAP side
+ * only asks for it to be cleared. Each request passes through the USB thread
+ * before it runs, so the clear is always done before the next read.
+ */
+static atomic_uint_least32_t _ring_clear_req;
+static uint32_t _ring_clear_done;
+
+static void dap_ring_stats_sync(void)
+{
+	uint32_t req = atomic_load_explicit(&_ring_clear_req, memory_order_acquire);
+
+	if (req != _ring_clear_done) {
+		_ring_clear_done = req;
+		dap_ring_stats.req_full = 0;
+	}
+}
+
+#if (SWO_STREAM != 0)
+/*
+ * SWO trace goes out on its own endpoint, queued by SWO_Thread. TinyUSB can't
+ * cancel a transfer, so an aborted one is left to finish and its completion is
+ * dropped. A transfer queued meanwhile is held back and started from there.
+ */
+static volatile bool _swo_busy;
+static volatile bool _swo_aborted;
+static uint8_t *_swo_next_buf;
+static uint32_t _swo_next_num;
+// SWO_AbortTransfer is called by DAP commands, which may be running on core 1
+static critical_section_t _swo_lock;
+#endif
+
+#if (PROBE_DAP_CORE1 != 0)
+/*
+ * DAP commands run on core 1, outside FreeRTOS, and only ever move the request
+ * ring's rptr and the response ring's wptr. Everything USB stays on core 0:
+ * core 1 releases dap_usb_sem after each response, and dap_thread then starts
+ * the IN transfer and re-arms a stalled OUT endpoint. Core 0 wakes core 1 with
+ * an event, which it latches if core 1 isn't yet waiting.
+ */
+static semaphore_t dap_usb_sem;
+#define dap_wake() __sev()
+#define dap_wait() __wfe()
+#else
+// A notification given before dap_thread waits is kept, so no wake-up is lost
+#define dap_wake() xTaskNotifyGive(dap_taskhandle)
+#define dap_wait() ulTaskNotifyTake(pdTRUE, portMAX_DELAY)
+#endif
+
+#ifdef PROBE_RTT
+// Out of requests: poll RTT, then sleep until woken or the next poll is due
+static void dap_idle(void)
+{
+	uint32_t ms = probe_rtt_poll();
+
+	if (!ms)
+		dap_wait();
+#if (PROBE_DAP_CORE1 != 0)
+	else
+		best_effort_wfe_or_timeout(make_timeout_time_ms(ms));
+#else
+	else
+		ulTaskNotifyTake(pdTRUE, MAX(pdMS_TO_TICKS(ms), 1));
+#endif
+}
+#else
+#define dap_idle() dap_wait()
+#endif
 
 #define WR_IDX(x) (x.wptr % DAP_PACKET_COUNT)
 #define RD_IDX(x) (x.rptr % DAP_PACKET_COUNT)
@@ -27,23 +111,290 @@ static uint8_t DAPResponseBuffer[DAP_PACKET_SIZE];
 #define WR_SLOT_PTR(x) &(x.data[WR_IDX(x)][0])
 #define RD_SLOT_PTR(x) &(x.data[RD_IDX(x)][0])
 
-bool buffer_full(buffer_t *buffer)
+#if (PROBE_DEBUG_PROTOCOL == PROTO_DAP_V1)
+#if (DAP_PACKET_SIZE != CFG_TUD_HID_EP_BUFSIZE)
+#error "CMSIS-DAP v1 HID reports are fixed at CFG_TUD_HID_EP_BUFSIZE bytes"
+#endif
+
+/*
+ * CMSIS-DAP v1 reports go through the same rings. Each HID report is one
+ * whole request, and TinyUSB's HID driver re-arms its OUT endpoint itself,
+ * so there is nothing to arm. The host may not have more than
+ * DAP_PACKET_COUNT requests outstanding, which is all the ring holds.
+ */
+#define dap_out_arm() ((void)0)
+
+/*
+ * Send the oldest response. If the IN endpoint is busy, its completion callback
+ * takes over. tud_hid_report() takes the endpoint claim itself, so the ring
+ * can't be checked under it. Instead this only runs on the USB thread, like
+ * the completion callback, so neither can send a slot the other has released.
+ */
+static void dap_in_send(void *param)
+{
+	(void) param;
+
+	if (!buffer_empty(&USBResponseBuffer))
+		tud_hid_report(0, RD_SLOT_PTR(USBResponseBuffer), DAP_PACKET_SIZE);
+}
+
+// From the DAP side, hand the send to the USB thread
+static void dap_in_flush(void)
+{
+	usbd_defer_func(dap_in_send, NULL, false);
+}
+#else
+/*
+ * Endpoint transfers are started both from the USB thread's callbacks and from
+ * the DAP side. Whoever claims an idle endpoint starts it; if the claim fails,
+ * the endpoint is busy and its completion callback takes over. A claim that
+ * finds nothing to do is released and the ring checked again, in case the
+ * other side gave up on the claim meanwhile.
+ */
+
+// Arm the OUT endpoint on the next free request slot
+static void dap_out_arm(void)
 {
-	return ((buffer->wptr + 1) % DAP_PACKET_COUNT == buffer->rptr);
+	do {
+		if (!usbd_edpt_claim(_rhport, _out_ep_addr))
+			return;
+		if (!buffer_full(&USBRequestBuffer)) {
+			usbd_edpt_xfer(_rhport, _out_ep_addr, WR_SLOT_PTR(USBRequestBuffer), _out_ep_size);
+			return;
+		}
+		usbd_edpt_release(_rhport, _out_ep_addr);
+	} while (!buffer_full(&USBRequestBuffer));
 }
 
-bool buffer_empty(buffer_t *buffer)
+// Send the oldest response
+static void dap_in_flush(void)
 {
-	return (buffer->wptr == buffer->rptr);
+	do {
+		if (!usbd_edpt_claim(_rhport, _in_ep_addr))
+			return;
+		if (!buffer_empty(&USBResponseBuffer)) {
+			usbd_edpt_xfer(_rhport, _in_ep_addr, RD_SLOT_PTR(USBResponseBuffer),
+				       USBResponseBuffer.data_len[RD_IDX(USBResponseBuffer)]);
+			return;
+		}
+		usbd_edpt_release(_rhport, _in_ep_addr);
+	} while (!buffer_empty(&USBResponseBuffer));
+}
+
+#endif
+
+/*
+ * When DAP_PACKET_SIZE is larger than the endpoint size, a request arrives as
+ * several USB packets. Hosts don't terminate a request that is an exact multiple
+ * of the endpoint size with a ZLP, so the command itself has to say how long it
+ * is. Returns the request length, or more than len if more data is needed to tell.
+ */
+static uint32_t dap_request_len(const uint8_t *buf, uint32_t len)
+{
+	uint32_t count, pos, n;
+
+	if (len < 1)
+		return 1;
+
+	switch (buf[0]) {
+	case ID_DAP_Disconnect:
+	case ID_DAP_TransferAbort:
+	case ID_DAP_ResetTarget:
+	case ID_DAP_SWO_Status:
+		return 1;
+	case ID_DAP_Info:
+	case ID_DAP_Connect:
+	case ID_DAP_SWD_Configure:
+	case ID_DAP_JTAG_IDCODE:
+	case ID_DAP_SWO_Transport:
+	case ID_DAP_SWO_Mode:
+	case ID_DAP_SWO_Control:
+	case ID_DAP_SWO_ExtendedStatus:
+		return 2;
+	case ID_DAP_HostStatus:
+	case ID_DAP_Delay:
+	case ID_DAP_SWO_Data:
+		return 3;
+	case ID_DAP_SWJ_Clock:
+	case ID_DAP_SWO_Baudrate:
+		return 5;
+	case ID_DAP_TransferConfigure:
+	case ID_DAP_WriteABORT:
+		return 6;
+	case ID_DAP_SWJ_Pins:
+		return 7;
+	case ID_DAP_SWJ_Sequence:
+		if (len < 2)
+			return 2;
+		n = buf[1] ? buf[1] : 256;
+		return 2 + (n + 7) / 8;
+	case ID_DAP_JTAG_Configure:
+		if (len < 2)
+			return 2;
+		return 2 + buf[1];
+	case ID_DAP_SWD_Sequence:
+	case ID_DAP_JTAG_Sequence:
+		if (len < 2)
+			return 2;
+		count = buf[1];
+		for (pos = 2; count; count--) {
+			if (pos >= len)
+				return pos + 1;
+			n = buf[pos++];
+			// SWD input sequences carry no data, JTAG sequences always carry TDI
+			if (buf[0] == ID_DAP_JTAG_Sequence || !(n & SWD_SEQUENCE_DIN)) {
+				n &= SWD_SEQUENCE_CLK;
+				pos += ((n ? n : 64) + 7) / 8;
+			}
+		}
+		return pos;
+	case ID_DAP_Transfer:
+		if (len < 3)
+			return 3;
+		count = buf[2];
+		for (pos = 3; count; count--) {
+			if (pos >= len)
+				return pos + 1;
+			n = buf[pos++];
+			if (!(n & DAP_TRANSFER_RnW) || (n & DAP_TRANSFER_MATCH_VALUE))
+				pos += 4;
+		}
+		return pos;
+	case ID_DAP_TransferBlock:
+		if (len < 5)
+			return 5;
+		if (buf[4] & DAP_TRANSFER_RnW)
+			return 5;
+		return 5 + 4 * ((uint32_t)buf[2] | ((uint32_t)buf[3] << 8));
+	case ID_DAP_QueueCommands:
+	case ID_DAP_ExecuteCommands:
+		if (len < 2)
+			return 2;
+		count = buf[1];
+		for (pos = 2; count; count--) {
+			if (pos >= len)
+				return pos + 1;
+			pos += dap_request_len(&buf[pos], len - pos);
+		}
+		return pos;
+	// The probe's own vendor commands, as parsed in DAP_vendor.c
+	case ID_DAP_Vendor1:
+		return 1;
+	case ID_DAP_Vendor3:
+	case ID_DAP_Vendor6:
+	case ID_DAP_Vendor8:
+		return 2;
+	case ID_DAP_Vendor2:
+		return 3;
+	case ID_DAP_Vendor7:
+		return 5;
+	case ID_DAP_Vendor0:
+		if (len < 2)
+			return 2;
+		return (buf[1] == 1) ? 2 + 16 : 2;
+	case ID_DAP_Vendor4:
+		if (len < 2)
+			return 2;
+		switch (buf[1]) {
+		case 0:
+			return 2 + 28;
+		case 1:
+			return 2 + 20;
+		case 2:
+			return 2 + 4;
+		case 3:
+			// Byte count (u16), then the image data
+			if (len < 4)
+				return 4;
+			return 4 + ((uint32_t)buf[2] | ((uint32_t)buf[3] << 8));
+		default:
+			return 2;
+		}
+	case ID_DAP_Vendor5:
+		if (len < 2)
+			return 2;
+		return (buf[1] == 0) ? 2 + 14 : 2;
+	default:
+		// Other vendor commands - no way to tell, so take what has arrived
+		return len;
+	}
 }
 
 void dap_edpt_init(void) {
+#if (SWO_STREAM != 0)
+	critical_section_init(&_swo_lock);
+#endif
+#if (PROBE_DAP_CORE1 != 0)
+	sem_init(&dap_usb_sem, 0, 1);
+#endif
+}
+
+#if (SWO_STREAM != 0)
+void SWO_QueueTransfer(uint8_t *buf, uint32_t num)
+{
+	bool start;
+
+	critical_section_enter_blocking(&_swo_lock);
+	start = !_swo_busy;
+	if (start) {
+		_swo_busy = true;
+	} else {
+		_swo_next_buf = buf;
+		_swo_next_num = num;
+	}
+	critical_section_exit(&_swo_lock);
 
+	if (start && !usbd_edpt_xfer(_rhport, _swo_ep_addr, buf, num))
+		_swo_busy = false;
+}
+
+void SWO_AbortTransfer(void)
+{
+	critical_section_enter_blocking(&_swo_lock);
+	if (_swo_busy)
+		_swo_aborted = true;
+	_swo_next_buf = NULL;
+	critical_section_exit(&_swo_lock);
+}
+
+static void swo_edpt_xfer_cb(uint8_t rhport)
+{
+	bool aborted;
+	uint8_t *buf;
+	uint32_t num;
+
+	critical_section_enter_blocking(&_swo_lock);
+	aborted = _swo_aborted;
+	_swo_aborted = false;
+	buf = _swo_next_buf;
+	num = _swo_next_num;
+	_swo_next_buf = NULL;
+	_swo_busy = buf != NULL;
+	critical_section_exit(&_swo_lock);
+
+	if (buf && !usbd_edpt_xfer(rhport, _swo_ep_addr, buf, num))
+		_swo_busy = false;
+	if (!aborted)
+		SWO_TransferComplete();
+}
+#endif
+
+//  Initialise circular buffer indices
+static void dap_rings_reset(void)
+{
+	atomic_store(&USBResponseBuffer.wptr, 0);
+	atomic_store(&USBResponseBuffer.rptr, 0);
+	atomic_store(&USBRequestBuffer.wptr, 0);
+	atomic_store(&USBRequestBuffer.rptr, 0);
 }
 
 void dap_edpt_reset(uint8_t __unused rhport)
 {
 	itf_num = 0;
+#if (PROBE_DEBUG_PROTOCOL == PROTO_DAP_V1)
+	// The HID interface has no open callback here, so start over on a bus reset
+	dap_rings_reset();
+#endif
 }
 
 char * dap_cmd_string[] = {
@@ -77,6 +428,13 @@ char * dap_cmd_string[] = {
 	[ID_DAP_ExecuteCommands    ] = "DAP_ExecuteCommands",
 };
 
+static inline const char *dap_cmd_name(uint8_t id)
+{
+	if (id < sizeof(dap_cmd_string) / sizeof(dap_cmd_string[0]) && dap_cmd_string[id])
+		return dap_cmd_string[id];
+	return (id >= ID_DAP_Vendor0 && id <= ID_DAP_Vendor31) ? "DAP_Vendor" : "DAP_Invalid";
+}
+
 
 uint16_t dap_edpt_open(uint8_t __unused rhport, tusb_desc_interface_t const *itf_desc, uint16_t max_len)
 {
@@ -85,17 +443,10 @@ uint16_t dap_edpt_open(uint8_t __unused rhport, tusb_desc_interface_t const *itf
 			DAP_INTERFACE_SUBCLASS == itf_desc->bInterfaceSubClass &&
 			DAP_INTERFACE_PROTOCOL == itf_desc->bInterfaceProtocol, 0);
 
-	//  Initialise circular buffer indices
-	USBResponseBuffer.wptr = 0;
-	USBResponseBuffer.rptr = 0;
-	USBRequestBuffer.wptr = 0;
-	USBRequestBuffer.rptr = 0;
+	dap_rings_reset();
 
-	// Initialse full/empty flags
-	USBResponseBuffer.wasFull = false;
-	USBResponseBuffer.wasEmpty = true;
-	USBRequestBuffer.wasFull = false;
-	USBRequestBuffer.wasEmpty = true;
+	_out_rx_len = 0;
+	_in_zlp = false;
 
 	uint16_t const drv_len = sizeof(tusb_desc_interface_t) + (itf_desc->bNumEndpoints * sizeof(tusb_desc_endpoint_t));
 	TU_VERIFY(max_len >= drv_len, 0);
@@ -107,10 +458,12 @@ uint16_t dap_edpt_open(uint8_t __unused rhport, tusb_desc_interface_t const *itf
 	uint8_t ep_addr = edpt_desc->bEndpointAddress;
 
 	_out_ep_addr = ep_addr;
+	_out_ep_size = TU_MIN(tu_edpt_packet_size(edpt_desc), DAP_PACKET_SIZE);
 
 	// The OUT endpoint requires a call to usbd_edpt_xfer to initialise the endpoint, giving tinyUSB a buffer to consume when a transfer occurs at the endpoint
+	// Requests are received one USB packet at a time, so that dap_edpt_xfer_cb can tell where a multi-packet request ends
 	usbd_edpt_open(rhport, edpt_desc);
-	usbd_edpt_xfer(rhport, ep_addr, WR_SLOT_PTR(USBRequestBuffer), DAP_PACKET_SIZE);
+	usbd_edpt_xfer(rhport, ep_addr, WR_SLOT_PTR(USBRequestBuffer), _out_ep_size);
 
 	// Initiliasing the IN endpoint
 
@@ -118,10 +471,24 @@ uint16_t dap_edpt_open(uint8_t __unused rhport, tusb_desc_interface_t const *itf
 	ep_addr = edpt_desc->bEndpointAddress;
 
 	_in_ep_addr = ep_addr;
+	_in_ep_size = tu_edpt_packet_size(edpt_desc);
 
 	// The IN endpoint doesn't need a transfer to initialise it, as this will be done by the main loop of dap_thread
 	usbd_edpt_open(rhport, edpt_desc);
 
+	// CMSIS-DAP v2 puts the optional SWO trace endpoint after the request and response endpoints
+	_swo_ep_addr = 0;
+	if (itf_desc->bNumEndpoints > 2) {
+		edpt_desc++;
+		_swo_ep_addr = edpt_desc->bEndpointAddress;
+		usbd_edpt_open(rhport, edpt_desc);
+#if (SWO_STREAM != 0)
+		_swo_busy = false;
+		_swo_aborted = false;
+		_swo_next_buf = NULL;
+#endif
+	}
+
 	return drv_len;
 
 }
@@ -131,29 +498,41 @@ bool dap_edpt_control_xfer_cb(uint8_t __unused rhport, uint8_t stage, tusb_contr
 	return false;
 }
 
-// Manage USBResponseBuffer (request) write and USBRequestBuffer (response) read indices
+// Manage USBRequestBuffer write and USBResponseBuffer read indices
 bool dap_edpt_xfer_cb(uint8_t __unused rhport, uint8_t ep_addr, xfer_result_t result, uint32_t xferred_bytes)
 {
 	const uint8_t ep_dir = tu_edpt_dir(ep_addr);
 
+#if (SWO_STREAM != 0)
+	if(_swo_ep_addr && ep_addr == _swo_ep_addr)
+	{
+		swo_edpt_xfer_cb(rhport);
+		return true;
+	}
+#endif
+
 	if(ep_dir == TUSB_DIR_IN)
 	{
 		if(xferred_bytes >= 0u && xferred_bytes <= DAP_PACKET_SIZE)
 		{
-			USBResponseBuffer.rptr++;
-
-			// This checks that the buffer was not empty in DAP thread, which means the next buffer was not queued up for the in endpoint callback
-			// So, queue up the buffer at the new read index, since we expect read to catch up to write at this point.
-			// It is possible for the read index to be multiple spaces behind the write index (if the USB callbacks are lagging behind dap thread),
-			// so we account for this by only setting wasEmpty to true if the next callback will empty the buffer
-			if(!USBResponseBuffer.wasEmpty)
+			// A response that fills a whole number of USB packets, but not the host's DAP_PACKET_SIZE
+			// read, needs a ZLP to end the transfer. Its completion comes back through here.
+			if(!_in_zlp && xferred_bytes && xferred_bytes < DAP_PACKET_SIZE && (xferred_bytes % _in_ep_size) == 0)
 			{
-				usbd_edpt_xfer(rhport, ep_addr, RD_SLOT_PTR(USBResponseBuffer), (uint16_t) _resp_len);
-				USBResponseBuffer.wasEmpty = (USBResponseBuffer.rptr + 1) == USBResponseBuffer.wptr;
+				_in_zlp = true;
+				usbd_edpt_xfer(rhport, ep_addr, NULL, 0);
+				return true;
 			}
+			_in_zlp = false;
+
+			buffer_pop(&USBResponseBuffer);
+
+			// dap_thread only starts an IN transfer when the endpoint is idle. Any responses
+			// it queued while this one was in flight are sent back-to-back from here.
+			dap_in_flush();
 
 			//  Wake up DAP thread after processing the callback
-			vTaskResume(dap_taskhandle);
+			dap_wake();
 			return true;
 		}
 
@@ -161,22 +540,35 @@ bool dap_edpt_xfer_cb(uint8_t __unused rhport, uint8_t ep_addr, xfer_result_t re
 
 	} else if(ep_dir == TUSB_DIR_OUT)    {
 
-		if(xferred_bytes >= 0u && xferred_bytes <= DAP_PACKET_SIZE)
+		if(xferred_bytes >= 0u && xferred_bytes <= DAP_PACKET_SIZE - _out_rx_len)
 		{
-			// Only queue the next buffer in the out callback if the buffer is not full
-			// If full, we set the wasFull flag, which will be checked by dap thread
-			if(!buffer_full(&USBRequestBuffer))
+			uint8_t *slot = WR_SLOT_PTR(USBRequestBuffer);
+
+			_out_rx_len += xferred_bytes;
+
+			// Keep filling the same slot until a short packet, a full DAP packet or a complete
+			// command has arrived. A ZLP on its own is the tail of the previous request.
+			if(_out_rx_len == 0 ||
+			   (xferred_bytes == _out_ep_size && _out_rx_len < DAP_PACKET_SIZE &&
+			    dap_request_len(slot, _out_rx_len) > _out_rx_len))
 			{
-				USBRequestBuffer.wptr++;
-				usbd_edpt_xfer(rhport, ep_addr, WR_SLOT_PTR(USBRequestBuffer), DAP_PACKET_SIZE);
-				USBRequestBuffer.wasFull = false;
-			}
-			else {
-				USBRequestBuffer.wasFull = true;
+				usbd_edpt_xfer(rhport, ep_addr, slot + _out_rx_len, _out_ep_size);
+				return true;
 			}
 
+			USBRequestBuffer.data_len[WR_IDX(USBRequestBuffer)] = _out_rx_len;
+			dap_ring_stats_sync();
+			buffer_push(&USBRequestBuffer);
+			_out_rx_len = 0;
+			if(buffer_full(&USBRequestBuffer))
+				dap_ring_stats.req_full++;
+
+			// Only queue the next buffer if there is a free slot. If the ring is full,
+			// the endpoint is left idle and the DAP side re-arms it once it has consumed a request.
+			dap_out_arm();
+
 			//  Wake up DAP thread after processing the callback
-			vTaskResume(dap_taskhandle);
+			dap_wake();
 			return true;
 		}
 
@@ -185,79 +577,197 @@ bool dap_edpt_xfer_cb(uint8_t __unused rhport, uint8_t ep_addr, xfer_result_t re
 	else return false;
 }
 
-void dap_thread(void *ptr)
+#if (PROBE_DEBUG_PROTOCOL == PROTO_DAP_V1)
+/*
+ * GET_REPORT is deliberately unsupported. CMSIS-DAP hosts read responses from
+ * the interrupt IN endpoint, and a control read couldn't be tied to a request
+ * in the ring. Returning 0 makes TinyUSB stall the request.
+ */
+uint16_t tud_hid_get_report_cb(uint8_t itf, uint8_t report_id, hid_report_type_t report_type, uint8_t* buffer, uint16_t reqlen)
+{
+	(void) itf;
+	(void) report_id;
+	(void) report_type;
+	(void) buffer;
+	(void) reqlen;
+
+	return 0;
+}
+
+// Queue a request report, in place of the vendor OUT endpoint
+void tud_hid_set_report_cb(uint8_t itf, uint8_t report_id, hid_report_type_t report_type, uint8_t const* buffer, uint16_t bufsize)
+{
+	// This doesn't use multiple report and report ID
+	(void) itf;
+	(void) report_id;
+	(void) report_type;
+
+	// A host that ignores the packet count has its request dropped
+	if (buffer_full(&USBRequestBuffer)) {
+		probe_info("DAP HID request dropped\n");
+		return;
+	}
+
+	bufsize = TU_MIN(bufsize, DAP_PACKET_SIZE);
+	memcpy(WR_SLOT_PTR(USBRequestBuffer), buffer, bufsize);
+	USBRequestBuffer.data_len[WR_IDX(USBRequestBuffer)] = bufsize;
+	dap_ring_stats_sync();
+	buffer_push(&USBRequestBuffer);
+	if (buffer_full(&USBRequestBuffer))
+		dap_ring_stats.req_full++;
+
+	dap_wake();
+}
+
+// TinyUSB has copied the response out, but the slot is only released here, as for the vendor IN endpoint
+#if (TUSB_VERSION_MAJOR == 0) && (TUSB_VERSION_MINOR <= 12)
+void tud_hid_report_complete_cb(uint8_t instance, uint8_t const* report, uint8_t len)
+#else
+void tud_hid_report_complete_cb(uint8_t instance, uint8_t const* report, uint16_t len)
+#endif
+{
+	(void) instance;
+	(void) report;
+	(void) len;
+
+	buffer_pop(&USBResponseBuffer);
+	dap_in_send(NULL);
+	dap_wake();
+}
+#endif
+
+/*
+ * Run the oldest request into the next response slot, leaving both rings'
+ * indices for the caller to move.
+ */
+static void dap_execute(void)
+{
+	uint32_t n, start;
+	uint8_t *request;
+	uint8_t *response;
+	uint8_t id;
+
+	/*
+	 * Atomic command support - buffer QueueCommands, but don't process them
+	 * until a non-QueueCommands packet is seen. If the queue fills the whole
+	 * ring, nothing more can arrive, so execute what we have.
+	 */
+	n = USBRequestBuffer.rptr;
+	while (USBRequestBuffer.data[n % DAP_PACKET_COUNT][0] == ID_DAP_QueueCommands) {
+		probe_info("%u %u DAP queued cmd %s len %02x\n",
+			       USBRequestBuffer.wptr, USBRequestBuffer.rptr,
+			       dap_cmd_name(USBRequestBuffer.data[n % DAP_PACKET_COUNT][0]), USBRequestBuffer.data[n % DAP_PACKET_COUNT][1]);
+		USBRequestBuffer.data[n % DAP_PACKET_COUNT][0] = ID_DAP_ExecuteCommands;
+		n++;
+		if (n == USBRequestBuffer.wptr && buffer_full(&USBRequestBuffer))
+			break;
+		while (n == USBRequestBuffer.wptr) {
+			/* Need yield in a loop here, as IN callbacks will also wake the thread */
+			probe_info("DAP wait\n");
+			dap_wait();
+		}
+	}
+
+	// The response is built in place, so wait for a free slot if the host has stopped reading
+	if (buffer_full(&USBResponseBuffer))
+		dap_ring_stats.resp_full++;
+	while (buffer_full(&USBResponseBuffer)) {
+		probe_info("DAP resp wait\n");
+		dap_wait();
+	}
+
+	request = RD_SLOT_PTR(USBRequestBuffer);
+	response = WR_SLOT_PTR(USBResponseBuffer);
+	probe_info("%u %u DAP cmd %s len %02x\n",
+		       USBRequestBuffer.wptr, USBRequestBuffer.rptr,
+		       dap_cmd_name(request[0]), request[1]);
+
+	id = request[0];
+	start = time_us_32();
+	n = DAP_ExecuteCommand(request, response);
+	start = time_us_32() - start;
+	dap_cmd_stats[id].count++;
+	dap_cmd_stats[id].total_us += start;
+	if (start > dap_cmd_stats[id].max_us)
+		dap_cmd_stats[id].max_us = start;
+	USBResponseBuffer.data_len[WR_IDX(USBResponseBuffer)] = (uint16_t) n;
+
+	// This was the last request the host had queued
+	if (USBRequestBuffer.wptr - USBRequestBuffer.rptr == 1)
+		dap_ring_stats.req_empty++;
+	probe_info("%u %u DAP resp %s\n",
+			USBResponseBuffer.wptr, USBResponseBuffer.rptr,
+			dap_cmd_name(response[0]));
+}
+
+#if (PROBE_DAP_CORE1 != 0)
+void dap_core1_thread(void)
 {
-	uint32_t n;
 	do
 	{
-		while(USBRequestBuffer.rptr != USBRequestBuffer.wptr)
+		while(!buffer_empty(&USBRequestBuffer))
 		{
-			/*
-			 * Atomic command support - buffer QueueCommands, but don't process them
-			 * until a non-QueueCommands packet is seen.
-			 */
-			n = USBRequestBuffer.rptr;
-			while (USBRequestBuffer.data[n % DAP_PACKET_COUNT][0] == ID_DAP_QueueCommands) {
-				probe_info("%u %u DAP queued cmd %s len %02x\n",
-					       USBRequestBuffer.wptr, USBRequestBuffer.rptr,
-					       dap_cmd_string[USBRequestBuffer.data[n % DAP_PACKET_COUNT][0]], USBRequestBuffer.data[n % DAP_PACKET_COUNT][1]);
-				USBRequestBuffer.data[n % DAP_PACKET_COUNT][0] = ID_DAP_ExecuteCommands;
-				n++;
-				while (n == USBRequestBuffer.wptr) {
-					/* Need yield in a loop here, as IN callbacks will also wake the thread */
-					probe_info("DAP wait\n");
-					vTaskSuspend(dap_taskhandle);
-				}
-			}
-			// Read a single packet from the USB buffer into the DAP Request buffer
-			memcpy(DAPRequestBuffer, RD_SLOT_PTR(USBRequestBuffer), DAP_PACKET_SIZE);
-			probe_info("%u %u DAP cmd %s len %02x\n",
-				       USBRequestBuffer.wptr, USBRequestBuffer.rptr,
-				       dap_cmd_string[DAPRequestBuffer[0]], DAPRequestBuffer[1]);
-			USBRequestBuffer.rptr++;
-
-			// If the buffer was full in the out callback, we need to queue up another buffer for the endpoint to consume, now that we know there is space in the buffer.
-			if(USBRequestBuffer.wasFull)
-			{
-				vTaskSuspendAll(); // Suspend the scheduler to safely update the write index
-				USBRequestBuffer.wptr++;
-				usbd_edpt_xfer(_rhport, _out_ep_addr, WR_SLOT_PTR(USBRequestBuffer), DAP_PACKET_SIZE);
-				USBRequestBuffer.wasFull = false;
-				xTaskResumeAll();
-			}
+			dap_execute();
 
-			_resp_len = DAP_ExecuteCommand(DAPRequestBuffer, DAPResponseBuffer);
-			probe_info("%u %u DAP resp %s\n",
-					USBResponseBuffer.wptr, USBResponseBuffer.rptr,
-					dap_cmd_string[DAPResponseBuffer[0]]);
+			// Publish the response only once it is complete, then leave the USB side to core 0
+			buffer_pop(&USBRequestBuffer);
+			buffer_push(&USBResponseBuffer);
+			sem_release(&dap_usb_sem);
+		}
 
+		dap_idle();
 
-			//  Suspend the scheduler to avoid stale values/race conditions between threads
-			vTaskSuspendAll();
+	} while (1);
+}
 
-			if(buffer_empty(&USBResponseBuffer))
-			{
-				memcpy(WR_SLOT_PTR(USBResponseBuffer), DAPResponseBuffer, (uint16_t) _resp_len);
-				USBResponseBuffer.wptr++;
+void dap_thread(void *ptr)
+{
+	do
+	{
+		sem_acquire_blocking(&dap_usb_sem);
+		dap_out_arm();
+		dap_in_flush();
 
-				usbd_edpt_xfer(_rhport, _in_ep_addr, RD_SLOT_PTR(USBResponseBuffer), (uint16_t) _resp_len);
-			} else {
+	} while (1);
+}
+#else
+void dap_thread(void *ptr)
+{
+	do
+	{
+		while(!buffer_empty(&USBRequestBuffer))
+		{
+			dap_execute();
 
-				memcpy(WR_SLOT_PTR(USBResponseBuffer), DAPResponseBuffer, (uint16_t) _resp_len);
-				USBResponseBuffer.wptr++;
+			// The request slot is only released once the command has run out of it.
+			// If the out callback found the ring full, it left the endpoint for us to re-arm.
+			buffer_pop(&USBRequestBuffer);
+			buffer_push(&USBResponseBuffer);
+			dap_out_arm();
 
-				// The In callback needs to check this flag to know when to queue up the next buffer.
-				USBResponseBuffer.wasEmpty = false;
-			}
-			xTaskResumeAll();
+			// If the IN endpoint is idle, start it on this response. Otherwise the
+			// IN callback picks it up when the responses ahead of it have gone.
+			dap_in_flush();
 		}
 
-		// Suspend DAP thread until it is awoken by a USB thread callback
-		vTaskSuspend(dap_taskhandle);
+		// Wait until woken by a USB thread callback
+		dap_idle();
 
 	} while (1);
 
 }
+#endif
+
+// Runs on the DAP side, from vendor command 0x83
+void dap_stats_clear(void)
+{
+	memset(dap_cmd_stats, 0, sizeof(dap_cmd_stats));
+	memset(&dap_xfer_stats, 0, sizeof(dap_xfer_stats));
+	dap_ring_stats.req_empty = 0;
+	dap_ring_stats.resp_full = 0;
+	atomic_store_explicit(&_ring_clear_req, atomic_load_explicit(&_ring_clear_req, memory_order_relaxed) + 1,
+			      memory_order_release);
+}
 
 usbd_class_driver_t const _dap_edpt_driver =
 {
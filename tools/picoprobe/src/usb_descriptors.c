@@ -28,6 +28,7 @@
 #include "tusb.h"
 #include "get_serial.h"
 #include "probe_config.h"
+#include "DAP_config.h"
 
 //--------------------------------------------------------------------+
 // Device Descriptors
@@ -71,6 +72,14 @@ enum
   ITF_NUM_PROBE, // Old versions of Keil MDK only look at interface 0
   ITF_NUM_CDC_COM,
   ITF_NUM_CDC_DATA,
+#ifdef PROBE_TRACE
+  ITF_NUM_TRACE_COM,
+  ITF_NUM_TRACE_DATA,
+#endif
+#ifdef PROBE_RTT
+  ITF_NUM_RTT_COM,
+  ITF_NUM_RTT_DATA,
+#endif
   ITF_NUM_TOTAL
 };
 
@@ -79,13 +88,47 @@ enum
 #define CDC_DATA_IN_EP_NUM 0x83
 #define DAP_OUT_EP_NUM 0x04
 #define DAP_IN_EP_NUM 0x85
+#define SWO_IN_EP_NUM 0x86
+#define TRACE_NOTIFICATION_EP_NUM 0x87
+#define TRACE_DATA_OUT_EP_NUM 0x08
+#define TRACE_DATA_IN_EP_NUM 0x89
+#define RTT_NOTIFICATION_EP_NUM 0x8A
+#define RTT_DATA_OUT_EP_NUM 0x0B
+#define RTT_DATA_IN_EP_NUM 0x8C
+
+// CMSIS-DAP v2 with SWO streaming: the SWO trace endpoint is a third, IN-only,
+// bulk endpoint on the DAP interface.
+#define TUD_VENDOR_SWO_DESC_LEN (TUD_VENDOR_DESC_LEN + 7)
+#define TUD_VENDOR_SWO_DESCRIPTOR(_itfnum, _stridx, _epout, _epin, _epswo, _epsize) \
+  /* Interface */\
+  9, TUSB_DESC_INTERFACE, _itfnum, 0, 3, TUSB_CLASS_VENDOR_SPECIFIC, 0x00, 0x00, _stridx,\
+  /* Endpoint Out */\
+  7, TUSB_DESC_ENDPOINT, _epout, TUSB_XFER_BULK, U16_TO_U8S_LE(_epsize), 0,\
+  /* Endpoint In */\
+  7, TUSB_DESC_ENDPOINT, _epin, TUSB_XFER_BULK, U16_TO_U8S_LE(_epsize), 0,\
+  /* Endpoint In, SWO */\
+  7, TUSB_DESC_ENDPOINT, _epswo, TUSB_XFER_BULK, U16_TO_U8S_LE(_epsize), 0
 
 #if (PROBE_DEBUG_PROTOCOL == PROTO_DAP_V1)
 #define CONFIG_TOTAL_LEN  (TUD_CONFIG_DESC_LEN + TUD_CDC_DESC_LEN + TUD_HID_INOUT_DESC_LEN)
+#elif (PROBE_DEBUG_PROTOCOL == PROTO_DAP_V2) && (SWO_STREAM != 0)
+#define CONFIG_TOTAL_LEN  (TUD_CONFIG_DESC_LEN + TUD_CDC_DESC_LEN + TUD_VENDOR_SWO_DESC_LEN)
 #else
 #define CONFIG_TOTAL_LEN  (TUD_CONFIG_DESC_LEN + TUD_CDC_DESC_LEN + TUD_VENDOR_DESC_LEN)
 #endif
 
+#ifdef PROBE_TRACE
+#define TRACE_DESC_LEN TUD_CDC_DESC_LEN
+#else
+#define TRACE_DESC_LEN 0
+#endif
+
+#ifdef PROBE_RTT
+#define RTT_DESC_LEN TUD_CDC_DESC_LEN
+#else
+#define RTT_DESC_LEN 0
+#endif
+
 static uint8_t const desc_hid_report[] =
 {
   TUD_HID_REPORT_DESC_GENERIC_INOUT(CFG_TUD_HID_EP_BUFSIZE)
@@ -99,11 +142,14 @@ uint8_t const * tud_hid_descriptor_report_cb(uint8_t itf)
 
 uint8_t const desc_configuration[] =
 {
-  TUD_CONFIG_DESCRIPTOR(1, ITF_NUM_TOTAL, 0, CONFIG_TOTAL_LEN, 0, 100),
+  TUD_CONFIG_DESCRIPTOR(1, ITF_NUM_TOTAL, 0, CONFIG_TOTAL_LEN + TRACE_DESC_LEN + RTT_DESC_LEN, 0, 100),
   // Interface 0
 #if (PROBE_DEBUG_PROTOCOL == PROTO_DAP_V1)
   // HID (named interface)
   TUD_HID_INOUT_DESCRIPTOR(ITF_NUM_PROBE, 4, HID_ITF_PROTOCOL_NONE, sizeof(desc_hid_report), DAP_OUT_EP_NUM, DAP_IN_EP_NUM, CFG_TUD_HID_EP_BUFSIZE, 1),
+#elif (PROBE_DEBUG_PROTOCOL == PROTO_DAP_V2) && (SWO_STREAM != 0)
+  // Bulk (named interface), with SWO trace
+  TUD_VENDOR_SWO_DESCRIPTOR(ITF_NUM_PROBE, 5, DAP_OUT_EP_NUM, DAP_IN_EP_NUM, SWO_IN_EP_NUM, 64),
 #elif (PROBE_DEBUG_PROTOCOL == PROTO_DAP_V2)
   // Bulk (named interface)
   TUD_VENDOR_DESCRIPTOR(ITF_NUM_PROBE, 5, DAP_OUT_EP_NUM, DAP_IN_EP_NUM, 64),
@@ -113,6 +159,14 @@ uint8_t const desc_configuration[] =
 #endif
   // Interface 1 + 2
   TUD_CDC_DESCRIPTOR(ITF_NUM_CDC_COM, 6, CDC_NOTIFICATION_EP_NUM, 64, CDC_DATA_OUT_EP_NUM, CDC_DATA_IN_EP_NUM, 64),
+#ifdef PROBE_TRACE
+  // Interface 3 + 4
+  TUD_CDC_DESCRIPTOR(ITF_NUM_TRACE_COM, 7, TRACE_NOTIFICATION_EP_NUM, 64, TRACE_DATA_OUT_EP_NUM, TRACE_DATA_IN_EP_NUM, 64),
+#endif
+#ifdef PROBE_RTT
+  // Interface 3 + 4, or 5 + 6 after the trace log
+  TUD_CDC_DESCRIPTOR(ITF_NUM_RTT_COM, 8, RTT_NOTIFICATION_EP_NUM, 64, RTT_DATA_OUT_EP_NUM, RTT_DATA_IN_EP_NUM, 64),
+#endif
 };
 
 // Invoked when received GET CONFIGURATION DESCRIPTOR
@@ -138,6 +192,8 @@ char const* string_desc_arr [] =
   "CMSIS-DAP v1 Interface", // 4: Interface descriptor for HID transport
   "CMSIS-DAP v2 Interface", // 5: Interface descriptor for Bulk transport
   "CDC-ACM UART Interface", // 6: Interface descriptor for CDC
+  "Debugprobe Trace", // 7: Interface descriptor for the trace log CDC
+  "Debugprobe RTT", // 8: Interface descriptor for the RTT CDC
 };
 
 static uint16_t _desc_str[32];
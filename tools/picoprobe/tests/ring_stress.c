@@ -0,0 +1,101 @@
+/**
+ * Copyright (c) 2023 Raspberry Pi (Trading) Ltd.
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+
+/*
+ * Host stress test for the DAP rings in dap_ring.h. One thread produces and
+ * one consumes, as the USB and DAP threads do on the probe. Every packet
+ * carries a sequence number and a pattern derived from it, so the consumer
+ * sees any packet that is lost, duplicated, reordered or read torn. The
+ * waits yield, so that the test also runs on a single-CPU host.
+ */
+
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifndef DAP_PACKET_COUNT
+#define DAP_PACKET_COUNT 8
+#endif
+#ifndef DAP_PACKET_SIZE
+#define DAP_PACKET_SIZE 64
+#endif
+
+#include "dap_ring.h"
+
+static buffer_t ring;
+static uint32_t packets = 2000000;
+
+static void fill(uint8_t *slot, uint32_t seq, uint16_t len)
+{
+	memcpy(slot, &seq, sizeof(seq));
+	for (uint16_t i = sizeof(seq); i < len; i++)
+		slot[i] = (uint8_t)(seq * 31 + i);
+}
+
+static void *producer(void *arg)
+{
+	(void)arg;
+	for (uint32_t seq = 0; seq < packets; seq++) {
+		while (buffer_full(&ring))
+			sched_yield();
+		uint32_t idx = atomic_load_explicit(&ring.wptr, memory_order_relaxed) % DAP_PACKET_COUNT;
+		uint16_t len = sizeof(seq) + seq % (DAP_PACKET_SIZE - sizeof(seq) + 1);
+		fill(ring.data[idx], seq, len);
+		ring.data_len[idx] = len;
+		buffer_push(&ring);
+	}
+	return NULL;
+}
+
+static void *consumer(void *arg)
+{
+	uint32_t *errors = arg;
+	uint8_t expect[DAP_PACKET_SIZE];
+
+	for (uint32_t seq = 0; seq < packets; seq++) {
+		while (buffer_empty(&ring))
+			sched_yield();
+		uint32_t idx = atomic_load_explicit(&ring.rptr, memory_order_relaxed) % DAP_PACKET_COUNT;
+		uint16_t len = ring.data_len[idx];
+		uint32_t got;
+		memcpy(&got, ring.data[idx], sizeof(got));
+		fill(expect, seq, len);
+		if (got != seq || len != sizeof(seq) + seq % (DAP_PACKET_SIZE - sizeof(seq) + 1) ||
+		    memcmp(ring.data[idx], expect, len) != 0) {
+			if (*errors < 10)
+				fprintf(stderr, "packet %u: got sequence %u, length %u\n", seq, got, len);
+			(*errors)++;
+		}
+		buffer_pop(&ring);
+	}
+	return NULL;
+}
+
+int main(int argc, char **argv)
+{
+	pthread_t prod, cons;
+	uint32_t errors = 0;
+
+	if (argc > 1)
+		packets = strtoul(argv[1], NULL, 0);
+
+	if (pthread_create(&cons, NULL, consumer, &errors) || pthread_create(&prod, NULL, producer, NULL)) {
+		fprintf(stderr, "can't start threads\n");
+		return 2;
+	}
+	pthread_join(prod, NULL);
+	pthread_join(cons, NULL);
+
+	uint32_t wptr = atomic_load(&ring.wptr), rptr = atomic_load(&ring.rptr);
+	if (wptr != packets || rptr != packets) {
+		fprintf(stderr, "ring ended at wptr %u rptr %u, expected %u\n", wptr, rptr, packets);
+		errors++;
+	}
+	printf("%u packets through a %u slot ring, %u errors\n", packets, DAP_PACKET_COUNT, errors);
+	return errors ? 1 : 0;
+}